@@ -16,6 +16,12 @@
 #ifndef CTEST_H
 #define CTEST_H
 
+#if defined(CTEST_MAIN) && !defined(_WIN32) && !defined(_DEFAULT_SOURCE) && !defined(_FEATURES_H) && !defined(_SYS_FEATURES_H)
+/* fork(), mmap(), kill() etc are hidden in strict (-std=c99) mode otherwise.
+ * Too late once a system header was included, see CTEST_IMPL_POSIX */
+#define _DEFAULT_SOURCE
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -32,12 +38,14 @@ extern "C" {
 
 typedef void (*ctest_nullary_run_func)(void);
 typedef void (*ctest_unary_run_func)(void*);
+typedef void (*ctest_param_run_func)(size_t);
 typedef void (*ctest_setup_func)(void*);
 typedef void (*ctest_teardown_func)(void*);
 
 union ctest_run_func_union {
     ctest_nullary_run_func nullary;
     ctest_unary_run_func unary;
+    ctest_param_run_func param;
 };
 
 #define CTEST_IMPL_PRAGMA(x) _Pragma (#x)
@@ -65,13 +73,23 @@ union ctest_run_func_union {
 struct ctest {
     const char* ssname;  // suite name
     const char* ttname;  // test name
+    const char* file;    // where the test is defined
     union ctest_run_func_union run;
 
     void* data;
     ctest_setup_func* setup;
     ctest_teardown_func* teardown;
+    ctest_setup_func* suite_setup;
+    ctest_teardown_func* suite_teardown;
+    size_t datasize;
 
     int skip;
+    int kind;   // CTEST_IMPL_KIND_*
+    int line;
+    unsigned int budget_ms;     // 0 if the test has no time budget
+    unsigned int timeout_ms;    // 0 for the --timeout default
+    size_t num_cases;   // CTEST_PARAM: rows in the table, 0 for other tests
+    size_t case_index;  // the row of a selected case
 
     unsigned int magic;
 };
@@ -79,6 +97,7 @@ struct ctest {
 #define CTEST_IMPL_NAME(name) ctest_##name
 #define CTEST_IMPL_FNAME(sname, tname) CTEST_IMPL_NAME(sname##_##tname##_run)
 #define CTEST_IMPL_TNAME(sname, tname) CTEST_IMPL_NAME(sname##_##tname)
+#define CTEST_IMPL_PNAME(sname, tname) CTEST_IMPL_NAME(sname##_##tname##_param)
 #define CTEST_IMPL_DATA_SNAME(sname) CTEST_IMPL_NAME(sname##_data)
 #define CTEST_IMPL_DATA_TNAME(sname, tname) CTEST_IMPL_NAME(sname##_##tname##_data)
 #define CTEST_IMPL_SETUP_FNAME(sname) CTEST_IMPL_NAME(sname##_setup)
@@ -87,23 +106,44 @@ struct ctest {
 #define CTEST_IMPL_TEARDOWN_FNAME(sname) CTEST_IMPL_NAME(sname##_teardown)
 #define CTEST_IMPL_TEARDOWN_FPNAME(sname) CTEST_IMPL_NAME(sname##_teardown_ptr)
 #define CTEST_IMPL_TEARDOWN_TPNAME(sname, tname) CTEST_IMPL_NAME(sname##_##tname##_teardown_ptr)
+#define CTEST_IMPL_SUITE_SETUP_FNAME(sname) CTEST_IMPL_NAME(sname##_suite_setup)
+#define CTEST_IMPL_SUITE_SETUP_FPNAME(sname) CTEST_IMPL_NAME(sname##_suite_setup_ptr)
+#define CTEST_IMPL_SUITE_TEARDOWN_FNAME(sname) CTEST_IMPL_NAME(sname##_suite_teardown)
+#define CTEST_IMPL_SUITE_TEARDOWN_FPNAME(sname) CTEST_IMPL_NAME(sname##_suite_teardown_ptr)
+
+#define CTEST_IMPL_KIND_TEST 0
+#define CTEST_IMPL_KIND_BENCH 1
+#define CTEST_IMPL_KIND_PROPERTY 2
 
 #define CTEST_IMPL_MAGIC (0xdeadbeef)
 #ifdef __APPLE__
 #define CTEST_IMPL_SECTION __attribute__ ((used, section ("__DATA, .ctest"), aligned(8)))
+#elif defined(__ELF__)
+/* the linker defines __start_ctest/__stop_ctest for sections named like a C identifier */
+#define CTEST_IMPL_SECTION __attribute__ ((used, section ("ctest"), aligned(__alignof__(struct ctest))))
 #else
 #define CTEST_IMPL_SECTION __attribute__ ((used, section (".ctest"), aligned(1)))
 #endif
 
-#define CTEST_IMPL_STRUCT(sname, tname, tskip, tdata, tsetup, tteardown) \
+#define CTEST_IMPL_STRUCT(sname, tname, tskip, tdata, tsetup, tteardown, tsuite_setup, tsuite_teardown, tdatasize, tkind, tbudget, ttimeout, tcases) \
     static struct ctest CTEST_IMPL_TNAME(sname, tname) CTEST_IMPL_SECTION = { \
         #sname, \
         #tname, \
+        __FILE__, \
         { (ctest_nullary_run_func) CTEST_IMPL_FNAME(sname, tname) }, \
         tdata, \
         (ctest_setup_func*) tsetup, \
         (ctest_teardown_func*) tteardown, \
+        (ctest_setup_func*) tsuite_setup, \
+        (ctest_teardown_func*) tsuite_teardown, \
+        tdatasize, \
         tskip, \
+        tkind, \
+        __LINE__, \
+        tbudget, \
+        ttimeout, \
+        tcases, \
+        0, \
         CTEST_IMPL_MAGIC, \
     }
 
@@ -115,22 +155,49 @@ struct ctest {
 #define CTEST_TEARDOWN(sname) \
     template <> void CTEST_IMPL_TEARDOWN_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data)
 
+/* the suite data is copied into every test, see ctest_suite_enter() */
+#define CTEST_IMPL_SUITE_DATA_CHECK(sname) \
+    static_assert(std::is_trivially_copyable<struct CTEST_IMPL_DATA_SNAME(sname)>::value, \
+                  "the CTEST_DATA of a suite with a suite setup/teardown must be trivially copyable")
+
+#define CTEST_SUITE_SETUP(sname) \
+    CTEST_IMPL_SUITE_DATA_CHECK(sname); \
+    static void CTEST_IMPL_SUITE_SETUP_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data); \
+    template <> void (*CTEST_IMPL_SUITE_SETUP_FPNAME(sname)<struct CTEST_IMPL_DATA_SNAME(sname)>::ptr)(struct CTEST_IMPL_DATA_SNAME(sname)*) = \
+        &CTEST_IMPL_SUITE_SETUP_FNAME(sname); \
+    static void CTEST_IMPL_SUITE_SETUP_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data)
+
+#define CTEST_SUITE_TEARDOWN(sname) \
+    CTEST_IMPL_SUITE_DATA_CHECK(sname); \
+    static void CTEST_IMPL_SUITE_TEARDOWN_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data); \
+    template <> void (*CTEST_IMPL_SUITE_TEARDOWN_FPNAME(sname)<struct CTEST_IMPL_DATA_SNAME(sname)>::ptr)(struct CTEST_IMPL_DATA_SNAME(sname)*) = \
+        &CTEST_IMPL_SUITE_TEARDOWN_FNAME(sname); \
+    static void CTEST_IMPL_SUITE_TEARDOWN_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data)
+
+/* the suite fixtures stay NULL unless specialized, so a suite without them
+ * isn't grouped (and its data isn't copied) */
 #define CTEST_DATA(sname) \
     template <typename T> void CTEST_IMPL_SETUP_FNAME(sname)(T* data) { } \
     template <typename T> void CTEST_IMPL_TEARDOWN_FNAME(sname)(T* data) { } \
+    template <typename T> struct CTEST_IMPL_SUITE_SETUP_FPNAME(sname) { static void (*ptr)(T*); }; \
+    template <typename T> void (*CTEST_IMPL_SUITE_SETUP_FPNAME(sname)<T>::ptr)(T*) = NULL; \
+    template <typename T> struct CTEST_IMPL_SUITE_TEARDOWN_FPNAME(sname) { static void (*ptr)(T*); }; \
+    template <typename T> void (*CTEST_IMPL_SUITE_TEARDOWN_FPNAME(sname)<T>::ptr)(T*) = NULL; \
     struct CTEST_IMPL_DATA_SNAME(sname)
 
-#define CTEST_IMPL_CTEST(sname, tname, tskip) \
+#define CTEST_IMPL_CTEST(sname, tname, tskip, tkind, tbudget, ttimeout) \
     static void CTEST_IMPL_FNAME(sname, tname)(void); \
-    CTEST_IMPL_STRUCT(sname, tname, tskip, NULL, NULL, NULL); \
+    CTEST_IMPL_STRUCT(sname, tname, tskip, NULL, NULL, NULL, NULL, NULL, 0, tkind, tbudget, ttimeout, 0); \
     static void CTEST_IMPL_FNAME(sname, tname)(void)
 
-#define CTEST_IMPL_CTEST2(sname, tname, tskip) \
+#define CTEST_IMPL_CTEST2(sname, tname, tskip, tkind, tbudget, ttimeout) \
     static struct CTEST_IMPL_DATA_SNAME(sname) CTEST_IMPL_DATA_TNAME(sname, tname); \
     static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data); \
     static void (*CTEST_IMPL_SETUP_TPNAME(sname, tname))(struct CTEST_IMPL_DATA_SNAME(sname)*) = &CTEST_IMPL_SETUP_FNAME(sname)<struct CTEST_IMPL_DATA_SNAME(sname)>; \
     static void (*CTEST_IMPL_TEARDOWN_TPNAME(sname, tname))(struct CTEST_IMPL_DATA_SNAME(sname)*) = &CTEST_IMPL_TEARDOWN_FNAME(sname)<struct CTEST_IMPL_DATA_SNAME(sname)>; \
-    CTEST_IMPL_STRUCT(sname, tname, tskip, &CTEST_IMPL_DATA_TNAME(sname, tname), &CTEST_IMPL_SETUP_TPNAME(sname, tname), &CTEST_IMPL_TEARDOWN_TPNAME(sname, tname)); \
+    CTEST_IMPL_STRUCT(sname, tname, tskip, &CTEST_IMPL_DATA_TNAME(sname, tname), &CTEST_IMPL_SETUP_TPNAME(sname, tname), &CTEST_IMPL_TEARDOWN_TPNAME(sname, tname), \
+                      &CTEST_IMPL_SUITE_SETUP_FPNAME(sname)<struct CTEST_IMPL_DATA_SNAME(sname)>::ptr, \
+                      &CTEST_IMPL_SUITE_TEARDOWN_FPNAME(sname)<struct CTEST_IMPL_DATA_SNAME(sname)>::ptr, sizeof(struct CTEST_IMPL_DATA_SNAME(sname)), tkind, tbudget, ttimeout, 0); \
     static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data)
 
 #else
@@ -145,33 +212,130 @@ struct ctest {
     static void (*CTEST_IMPL_TEARDOWN_FPNAME(sname))(struct CTEST_IMPL_DATA_SNAME(sname)*) = &CTEST_IMPL_TEARDOWN_FNAME(sname); \
     static void CTEST_IMPL_TEARDOWN_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data)
 
+#define CTEST_SUITE_SETUP(sname) \
+    static void CTEST_IMPL_SUITE_SETUP_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data); \
+    static void (*CTEST_IMPL_SUITE_SETUP_FPNAME(sname))(struct CTEST_IMPL_DATA_SNAME(sname)*) = &CTEST_IMPL_SUITE_SETUP_FNAME(sname); \
+    static void CTEST_IMPL_SUITE_SETUP_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data)
+
+#define CTEST_SUITE_TEARDOWN(sname) \
+    static void CTEST_IMPL_SUITE_TEARDOWN_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data); \
+    static void (*CTEST_IMPL_SUITE_TEARDOWN_FPNAME(sname))(struct CTEST_IMPL_DATA_SNAME(sname)*) = &CTEST_IMPL_SUITE_TEARDOWN_FNAME(sname); \
+    static void CTEST_IMPL_SUITE_TEARDOWN_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data)
+
 #define CTEST_DATA(sname) \
     struct CTEST_IMPL_DATA_SNAME(sname); \
     static void (*CTEST_IMPL_SETUP_FPNAME(sname))(struct CTEST_IMPL_DATA_SNAME(sname)*); \
     static void (*CTEST_IMPL_TEARDOWN_FPNAME(sname))(struct CTEST_IMPL_DATA_SNAME(sname)*); \
+    static void (*CTEST_IMPL_SUITE_SETUP_FPNAME(sname))(struct CTEST_IMPL_DATA_SNAME(sname)*); \
+    static void (*CTEST_IMPL_SUITE_TEARDOWN_FPNAME(sname))(struct CTEST_IMPL_DATA_SNAME(sname)*); \
     struct CTEST_IMPL_DATA_SNAME(sname)
 
-#define CTEST_IMPL_CTEST(sname, tname, tskip) \
+#define CTEST_IMPL_CTEST(sname, tname, tskip, tkind, tbudget, ttimeout) \
     static void CTEST_IMPL_FNAME(sname, tname)(void); \
-    CTEST_IMPL_STRUCT(sname, tname, tskip, NULL, NULL, NULL); \
+    CTEST_IMPL_STRUCT(sname, tname, tskip, NULL, NULL, NULL, NULL, NULL, 0, tkind, tbudget, ttimeout, 0); \
     static void CTEST_IMPL_FNAME(sname, tname)(void)
 
-#define CTEST_IMPL_CTEST2(sname, tname, tskip) \
+#define CTEST_IMPL_CTEST2(sname, tname, tskip, tkind, tbudget, ttimeout) \
     static struct CTEST_IMPL_DATA_SNAME(sname) CTEST_IMPL_DATA_TNAME(sname, tname); \
     static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data); \
-    CTEST_IMPL_STRUCT(sname, tname, tskip, &CTEST_IMPL_DATA_TNAME(sname, tname), &CTEST_IMPL_SETUP_FPNAME(sname), &CTEST_IMPL_TEARDOWN_FPNAME(sname)); \
+    CTEST_IMPL_STRUCT(sname, tname, tskip, &CTEST_IMPL_DATA_TNAME(sname, tname), &CTEST_IMPL_SETUP_FPNAME(sname), &CTEST_IMPL_TEARDOWN_FPNAME(sname), \
+                      &CTEST_IMPL_SUITE_SETUP_FPNAME(sname), &CTEST_IMPL_SUITE_TEARDOWN_FPNAME(sname), sizeof(struct CTEST_IMPL_DATA_SNAME(sname)), tkind, tbudget, ttimeout, 0); \
     static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data)
 
 #endif
 
-void CTEST_LOG(const char* fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2);
-void CTEST_ERR(const char* fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2);  // doesn't return
+// log levels: messages above CTEST_LOG_LEVEL are compiled out, their
+// arguments aren't even evaluated. Failures are always logged
+#define CTEST_LOG_NONE 0
+#define CTEST_LOG_INFO 1    // CTEST_LOG
+#define CTEST_LOG_DEBUG 2   // CTEST_DEBUG
+#ifndef CTEST_LOG_LEVEL
+#define CTEST_LOG_LEVEL CTEST_LOG_DEBUG
+#endif
+
+void ctest_log(int level, const char* fmt, ...) CTEST_IMPL_FORMAT_PRINTF(2, 3);
+// Fails the test and doesn't return, except in a thread the test started:
+// there it returns and the thread goes on, the test fails when it ends. So
+// an assert in such a thread doesn't protect the code after it
+void CTEST_ERR(const char* fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2);
+
+#if CTEST_LOG_LEVEL >= CTEST_LOG_INFO
+#define CTEST_LOG(...) ctest_log(CTEST_LOG_INFO, __VA_ARGS__)
+#else
+#define CTEST_LOG(...) do { if (0) ctest_log(CTEST_LOG_INFO, __VA_ARGS__); } while (0)
+#endif
+#if CTEST_LOG_LEVEL >= CTEST_LOG_DEBUG
+#define CTEST_DEBUG(...) ctest_log(CTEST_LOG_DEBUG, __VA_ARGS__)
+#else
+#define CTEST_DEBUG(...) do { if (0) ctest_log(CTEST_LOG_DEBUG, __VA_ARGS__); } while (0)
+#endif
+
+#define CTEST(sname, tname) CTEST_IMPL_CTEST(sname, tname, 0, CTEST_IMPL_KIND_TEST, 0, 0)
+#define CTEST_SKIP(sname, tname) CTEST_IMPL_CTEST(sname, tname, 1, CTEST_IMPL_KIND_TEST, 0, 0)
 
-#define CTEST(sname, tname) CTEST_IMPL_CTEST(sname, tname, 0)
-#define CTEST_SKIP(sname, tname) CTEST_IMPL_CTEST(sname, tname, 1)
+#define CTEST2(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 0, CTEST_IMPL_KIND_TEST, 0, 0)
+#define CTEST2_SKIP(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 1, CTEST_IMPL_KIND_TEST, 0, 0)
 
-#define CTEST2(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 0)
-#define CTEST2_SKIP(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 1)
+// fails the test if it takes more than ms milliseconds (setup and teardown included)
+#define CTEST_BUDGET(sname, tname, ms) CTEST_IMPL_CTEST(sname, tname, 0, CTEST_IMPL_KIND_TEST, ms, 0)
+#define CTEST2_BUDGET(sname, tname, ms) CTEST_IMPL_CTEST2(sname, tname, 0, CTEST_IMPL_KIND_TEST, ms, 0)
+
+// stops the test after ms milliseconds, instead of the --timeout default
+#define CTEST_TIMEOUT(sname, tname, ms) CTEST_IMPL_CTEST(sname, tname, 0, CTEST_IMPL_KIND_TEST, 0, ms)
+#define CTEST2_TIMEOUT(sname, tname, ms) CTEST_IMPL_CTEST2(sname, tname, 0, CTEST_IMPL_KIND_TEST, 0, ms)
+
+// benchmarks: the body is one operation, called in a loop. Only run with --bench
+#define CTEST_BENCH(sname, tname) CTEST_IMPL_CTEST(sname, tname, 0, CTEST_IMPL_KIND_BENCH, 0, 0)
+#define CTEST_BENCH_SKIP(sname, tname) CTEST_IMPL_CTEST(sname, tname, 1, CTEST_IMPL_KIND_BENCH, 0, 0)
+
+// setup/teardown are called once around all iterations of a CTEST2_BENCH
+#define CTEST2_BENCH(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 0, CTEST_IMPL_KIND_BENCH, 0, 0)
+#define CTEST2_BENCH_SKIP(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 1, CTEST_IMPL_KIND_BENCH, 0, 0)
+
+// runs the body once for every row of a static array, as tests named tname/row.
+// param points to the row:
+//   CTEST_PARAM(parse, numbers, cases) { ASSERT_EQUAL(param->value, parse(param->text)); }
+#define CTEST_PARAM(sname, tname, table) \
+    static void CTEST_IMPL_PNAME(sname, tname)(const __typeof__((table)[0])* param); \
+    static void CTEST_IMPL_FNAME(sname, tname)(size_t ctest_row) { \
+        CTEST_IMPL_PNAME(sname, tname)(&(table)[ctest_row]); \
+    } \
+    CTEST_IMPL_STRUCT(sname, tname, 0, NULL, NULL, NULL, NULL, NULL, 0, CTEST_IMPL_KIND_TEST, 0, 0, sizeof(table) / sizeof((table)[0])); \
+    static void CTEST_IMPL_PNAME(sname, tname)(const __typeof__((table)[0])* param)
+
+// like CTEST_PARAM, with rows made by gen(row, &value) instead of a table.
+// count must be a constant expression
+#define CTEST_PARAM_GEN(sname, tname, type, count, gen) \
+    static void CTEST_IMPL_PNAME(sname, tname)(const type* param); \
+    static void CTEST_IMPL_FNAME(sname, tname)(size_t ctest_row) { \
+        type ctest_value; \
+        gen(ctest_row, &ctest_value); \
+        CTEST_IMPL_PNAME(sname, tname)(&ctest_value); \
+    } \
+    CTEST_IMPL_STRUCT(sname, tname, 0, NULL, NULL, NULL, NULL, NULL, 0, CTEST_IMPL_KIND_TEST, 0, 0, count); \
+    static void CTEST_IMPL_PNAME(sname, tname)(const type* param)
+
+// property tests: the body is run many times (--prop-runs, --prop-time) with
+// inputs from the ctest_gen_* functions. A failing input is shrunk to a
+// minimal one, which is logged with the seed that replays it (--seed).
+// setup/teardown are called once around all runs of a CTEST2_PROPERTY
+#define CTEST_PROPERTY(sname, tname) CTEST_IMPL_CTEST(sname, tname, 0, CTEST_IMPL_KIND_PROPERTY, 0, 0)
+#define CTEST_PROPERTY_SKIP(sname, tname) CTEST_IMPL_CTEST(sname, tname, 1, CTEST_IMPL_KIND_PROPERTY, 0, 0)
+#define CTEST2_PROPERTY(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 0, CTEST_IMPL_KIND_PROPERTY, 0, 0)
+#define CTEST2_PROPERTY_SKIP(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 1, CTEST_IMPL_KIND_PROPERTY, 0, 0)
+
+// generated values shrink towards 0 (ints) and short runs of 0 bytes or 'a'.
+// Buffers and strings are valid until the next run, don't free them
+int64_t ctest_gen_int(int64_t min, int64_t max);
+const unsigned char* ctest_gen_bytes(size_t min_len, size_t max_len, size_t* len);
+const char* ctest_gen_str(size_t min_len, size_t max_len);
+
+// keeps the compiler from optimizing away a value computed in a benchmark
+#ifdef __GNUC__
+#define CTEST_BENCH_KEEP(value) __asm__ __volatile__("" : : "g"(value) : "memory")
+#else
+#define CTEST_BENCH_KEEP(value) do { volatile const void* ctest_keep_ = &(value); (void) ctest_keep_; } while (0)
+#endif
 
 
 void assert_str(const char* cmp, const char* exp, const char* real, const char* caller, int line);
@@ -192,58 +356,250 @@ void assert_data(const unsigned char* exp, size_t expsize,
 #define ASSERT_DATA(exp, expsize, real, realsize) \
     assert_data(exp, expsize, real, realsize, __FILE__, __LINE__)
 
+// compare with the contents of a (golden) file, which --update-golden writes instead
+void assert_data_file(const char* path, const unsigned char* real, size_t realsize, const char* caller, int line);
+void assert_str_file(const char* path, const char* real, const char* caller, int line);
+#define ASSERT_DATA_FILE(path, real, realsize) assert_data_file(path, real, realsize, __FILE__, __LINE__)
+#define ASSERT_STR_FILE(path, real) assert_str_file(path, real, __FILE__, __LINE__)
+
 #define CTEST_FLT_EPSILON 1e-5
 #define CTEST_DBL_EPSILON 1e-12
 
-void assert_compare(const char* cmp, intmax_t exp, intmax_t real, const char* caller, int line);
-#define ASSERT_EQUAL(exp, real) assert_compare("==", exp, real, __FILE__, __LINE__)
-#define ASSERT_NOT_EQUAL(exp, real) assert_compare("!=", exp, real, __FILE__, __LINE__)
+#ifdef __GNUC__
+#define CTEST_IMPL_COLD __attribute__ ((cold, noinline))
+#define CTEST_IMPL_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define CTEST_IMPL_CONST __attribute__ ((const))
+#else
+#define CTEST_IMPL_COLD
+#define CTEST_IMPL_UNLIKELY(x) (x)
+#define CTEST_IMPL_CONST
+#endif
+
+#ifdef _MSC_VER
+#define CTEST_IMPL_THREAD_LOCAL __declspec(thread)
+#else
+#define CTEST_IMPL_THREAD_LOCAL __thread
+#endif
+
+// Assertions run by this thread. Every thread counts its own, so a passing
+// assert is a plain increment. The first assert of a thread the test started
+// registers it, to add its count to the test's when it exits.
+// ctest_count_thread() changes nothing the test can see, it's const so the
+// compiler still keeps the count in a register in a loop of asserts
+extern CTEST_IMPL_THREAD_LOCAL uint64_t ctest_assert_count;
+extern CTEST_IMPL_THREAD_LOCAL int ctest_assert_thread;
+int ctest_count_thread(void) CTEST_IMPL_COLD CTEST_IMPL_CONST;
+
+#define CTEST_IMPL_COUNT_ASSERT() do { \
+    if (CTEST_IMPL_UNLIKELY(!ctest_assert_thread)) ctest_assert_thread = ctest_count_thread(); \
+    ctest_assert_count++; \
+} while (0)
+
+// The asserts below are inlined, their comparison is a constant that the
+// compiler resolves. Only a failure calls out of line, into a cold reporter
+enum ctest_cmp { CTEST_CMP_EQ, CTEST_CMP_NE, CTEST_CMP_LT, CTEST_CMP_LE, CTEST_CMP_GT, CTEST_CMP_GE };
+
+#define CTEST_IMPL_CMP(cmp, exp, real) \
+    ((cmp) == CTEST_CMP_EQ ? (exp) == (real) : (cmp) == CTEST_CMP_NE ? (exp) != (real) : \
+     (cmp) == CTEST_CMP_LT ? (exp) < (real) : (cmp) == CTEST_CMP_LE ? (exp) <= (real) : \
+     (cmp) == CTEST_CMP_GT ? (exp) > (real) : (exp) >= (real))
+
+void ctest_fail_compare(enum ctest_cmp cmp, intmax_t exp, intmax_t real, const char* caller, int line) CTEST_IMPL_COLD;
+void ctest_fail_compare_u(enum ctest_cmp cmp, uintmax_t exp, uintmax_t real, const char* caller, int line) CTEST_IMPL_COLD;
+void ctest_fail_values(enum ctest_cmp cmp, const char* exp, const char* real, const char* caller, int line) CTEST_IMPL_COLD;
+void ctest_fail_interval(intmax_t exp1, intmax_t exp2, intmax_t real, const char* caller, int line) CTEST_IMPL_COLD;
+void ctest_fail_dbl(enum ctest_cmp cmp, double exp, double real, double tol, const char* caller, int line) CTEST_IMPL_COLD;
+void ctest_fail_msg(const char* msg, const char* caller, int line) CTEST_IMPL_COLD;
+
+static inline void ctest_assert_compare(enum ctest_cmp cmp, intmax_t exp, intmax_t real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    if (CTEST_IMPL_UNLIKELY(!CTEST_IMPL_CMP(cmp, exp, real))) ctest_fail_compare(cmp, exp, real, caller, line);
+}
+
+static inline void ctest_assert_compare_u(enum ctest_cmp cmp, uintmax_t exp, uintmax_t real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    if (CTEST_IMPL_UNLIKELY(!CTEST_IMPL_CMP(cmp, exp, real))) ctest_fail_compare_u(cmp, exp, real, caller, line);
+}
+
+static inline void ctest_assert_interval(intmax_t exp1, intmax_t exp2, intmax_t real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    if (CTEST_IMPL_UNLIKELY(real < exp1 || real > exp2)) ctest_fail_interval(exp1, exp2, real, caller, line);
+}
+
+// tol < 0 means it is an epsilon (D.Knuth), else absolute error
+static inline void ctest_assert_dbl(enum ctest_cmp cmp, double exp, double real, double tol, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    double diff = exp < real ? real - exp : exp - real;
+    double a = exp < 0 ? -exp : exp;
+    double b = real < 0 ? -real : real;
+    bool eq = tol < 0 ? diff <= (a > b ? a : b) * -tol : diff <= tol;
+    bool ok = cmp == CTEST_CMP_EQ ? eq : cmp == CTEST_CMP_NE ? !eq :
+              cmp == CTEST_CMP_LT ? exp < real : cmp == CTEST_CMP_LE ? exp < real || eq :
+              cmp == CTEST_CMP_GT ? exp > real : exp > real || eq;
+    if (CTEST_IMPL_UNLIKELY(!ok)) ctest_fail_dbl(cmp, exp, real, tol, caller, line);
+}
+
+static inline void ctest_assert_true(bool real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    if (CTEST_IMPL_UNLIKELY(!real)) ctest_fail_msg("should be true", caller, line);
+}
+
+static inline void ctest_assert_false(bool real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    if (CTEST_IMPL_UNLIKELY(real)) ctest_fail_msg("should be false", caller, line);
+}
+
+static inline void ctest_assert_null(const void* real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    if (CTEST_IMPL_UNLIKELY(real != NULL)) ctest_fail_msg("should be NULL", caller, line);
+}
+
+static inline void ctest_assert_not_null(const void* real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    if (CTEST_IMPL_UNLIKELY(real == NULL)) ctest_fail_msg("should not be NULL", caller, line);
+}
+
+#if defined(__cplusplus) && __cplusplus >= 201103L
+}   // extern "C", templates need C++ linkage
+
+#include <cstdio>
+#include <type_traits>
+
+// C++ keeps the type of the values for the failure message: bool, char,
+// floating point, pointer, unsigned or signed (the rest)
+template <typename T>
+struct ctest_value_kind : std::integral_constant<int,
+        std::is_same<T, bool>::value ? 0 : std::is_same<T, char>::value ? 1 :
+        std::is_floating_point<T>::value ? 2 : std::is_pointer<T>::value ? 3 :
+        std::is_unsigned<T>::value ? 4 : 5> {};
+
+template <typename T>
+void ctest_format_value(char* buf, size_t size, T value, std::integral_constant<int, 0>) {
+    std::snprintf(buf, size, "%s", value ? "true" : "false");
+}
+
+template <typename T>
+void ctest_format_value(char* buf, size_t size, T value, std::integral_constant<int, 1>) {
+    if (value >= ' ' && value <= '~') std::snprintf(buf, size, "'%c'", value);
+    else std::snprintf(buf, size, "%d", (int) value);
+}
+
+template <typename T>
+void ctest_format_value(char* buf, size_t size, T value, std::integral_constant<int, 2>) {
+    std::snprintf(buf, size, "%.8g", (double) value);
+}
+
+template <typename T>
+void ctest_format_value(char* buf, size_t size, T value, std::integral_constant<int, 3>) {
+    std::snprintf(buf, size, "%p", (const void*) value);
+}
+
+template <typename T>
+void ctest_format_value(char* buf, size_t size, T value, std::integral_constant<int, 4>) {
+    std::snprintf(buf, size, "%" PRIuMAX, (uintmax_t) value);
+}
+
+template <typename T>
+void ctest_format_value(char* buf, size_t size, T value, std::integral_constant<int, 5>) {
+    std::snprintf(buf, size, "%" PRIdMAX, (intmax_t) value);
+}
+
+template <typename T, typename U>
+CTEST_IMPL_COLD void ctest_report_compare(enum ctest_cmp cmp, T exp, U real, const char* caller, int line) {
+    char exp_str[64];
+    char real_str[64];
+    ctest_format_value(exp_str, sizeof(exp_str), exp, ctest_value_kind<T>());
+    ctest_format_value(real_str, sizeof(real_str), real, ctest_value_kind<U>());
+    ctest_fail_values(cmp, exp_str, real_str, caller, line);
+}
+
+// compared as intmax_t (uintmax_t), like in C
+template <enum ctest_cmp cmp, typename T, typename U>
+inline void ctest_assert_compare_t(T exp, U real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    if (CTEST_IMPL_UNLIKELY(!CTEST_IMPL_CMP(cmp, (intmax_t) exp, (intmax_t) real))) ctest_report_compare(cmp, exp, real, caller, line);
+}
+
+template <enum ctest_cmp cmp, typename T, typename U>
+inline void ctest_assert_compare_ut(T exp, U real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    if (CTEST_IMPL_UNLIKELY(!CTEST_IMPL_CMP(cmp, (uintmax_t) exp, (uintmax_t) real))) ctest_report_compare(cmp, exp, real, caller, line);
+}
 
-#define ASSERT_LT(v1, v2) assert_compare("<", v1, v2, __FILE__, __LINE__)
-#define ASSERT_LE(v1, v2) assert_compare("<=", v1, v2, __FILE__, __LINE__)
-#define ASSERT_GT(v1, v2) assert_compare(">", v1, v2, __FILE__, __LINE__)
-#define ASSERT_GE(v1, v2) assert_compare(">=", v1, v2, __FILE__, __LINE__)
+extern "C" {
+#define CTEST_IMPL_ASSERT_CMP(cmp, exp, real) ctest_assert_compare_t<cmp>(exp, real, __FILE__, __LINE__)
+#define CTEST_IMPL_ASSERT_CMP_U(cmp, exp, real) ctest_assert_compare_ut<cmp>(exp, real, __FILE__, __LINE__)
+#else
+#define CTEST_IMPL_ASSERT_CMP(cmp, exp, real) ctest_assert_compare(cmp, exp, real, __FILE__, __LINE__)
+#define CTEST_IMPL_ASSERT_CMP_U(cmp, exp, real) ctest_assert_compare_u(cmp, exp, real, __FILE__, __LINE__)
+#endif
 
+// the out of line versions, with cmp as a string ("==", "<=", ...)
+void assert_compare(const char* cmp, intmax_t exp, intmax_t real, const char* caller, int line);
 void assert_compare_u(const char* cmp, uintmax_t exp, uintmax_t real, const char* caller, int line);
-#define ASSERT_EQUAL_U(exp, real) assert_compare_u("==", exp, real, __FILE__, __LINE__)
-#define ASSERT_NOT_EQUAL_U(exp, real) assert_compare_u("!=", exp, real, __FILE__, __LINE__)
+void assert_dbl_compare(const char* cmp, double exp, double real, double tol, const char* caller, int line);
+
+#define ASSERT_EQUAL(exp, real) CTEST_IMPL_ASSERT_CMP(CTEST_CMP_EQ, exp, real)
+#define ASSERT_NOT_EQUAL(exp, real) CTEST_IMPL_ASSERT_CMP(CTEST_CMP_NE, exp, real)
+
+#define ASSERT_LT(v1, v2) CTEST_IMPL_ASSERT_CMP(CTEST_CMP_LT, v1, v2)
+#define ASSERT_LE(v1, v2) CTEST_IMPL_ASSERT_CMP(CTEST_CMP_LE, v1, v2)
+#define ASSERT_GT(v1, v2) CTEST_IMPL_ASSERT_CMP(CTEST_CMP_GT, v1, v2)
+#define ASSERT_GE(v1, v2) CTEST_IMPL_ASSERT_CMP(CTEST_CMP_GE, v1, v2)
 
-#define ASSERT_LT_U(v1, v2) assert_compare_u("<", v1, v2, __FILE__, __LINE__)
-#define ASSERT_LE_U(v1, v2) assert_compare_u("<=", v1, v2, __FILE__, __LINE__)
-#define ASSERT_GT_U(v1, v2) assert_compare_u(">", v1, v2, __FILE__, __LINE__)
-#define ASSERT_GE_U(v1, v2) assert_compare_u(">=", v1, v2, __FILE__, __LINE__)
+#define ASSERT_EQUAL_U(exp, real) CTEST_IMPL_ASSERT_CMP_U(CTEST_CMP_EQ, exp, real)
+#define ASSERT_NOT_EQUAL_U(exp, real) CTEST_IMPL_ASSERT_CMP_U(CTEST_CMP_NE, exp, real)
+
+#define ASSERT_LT_U(v1, v2) CTEST_IMPL_ASSERT_CMP_U(CTEST_CMP_LT, v1, v2)
+#define ASSERT_LE_U(v1, v2) CTEST_IMPL_ASSERT_CMP_U(CTEST_CMP_LE, v1, v2)
+#define ASSERT_GT_U(v1, v2) CTEST_IMPL_ASSERT_CMP_U(CTEST_CMP_GT, v1, v2)
+#define ASSERT_GE_U(v1, v2) CTEST_IMPL_ASSERT_CMP_U(CTEST_CMP_GE, v1, v2)
 
 void assert_interval(intmax_t exp1, intmax_t exp2, intmax_t real, const char* caller, int line);
-#define ASSERT_INTERVAL(exp1, exp2, real) assert_interval(exp1, exp2, real, __FILE__, __LINE__)
+#define ASSERT_INTERVAL(exp1, exp2, real) ctest_assert_interval(exp1, exp2, real, __FILE__, __LINE__)
 
 void assert_null(void* real, const char* caller, int line);
-#define ASSERT_NULL(real) assert_null((void*)real, __FILE__, __LINE__)
+#define ASSERT_NULL(real) ctest_assert_null((const void*)(real), __FILE__, __LINE__)
 
 void assert_not_null(const void* real, const char* caller, int line);
-#define ASSERT_NOT_NULL(real) assert_not_null(real, __FILE__, __LINE__)
+#define ASSERT_NOT_NULL(real) ctest_assert_not_null(real, __FILE__, __LINE__)
 
 void assert_true(int real, const char* caller, int line);
-#define ASSERT_TRUE(real) assert_true(real, __FILE__, __LINE__)
+#define ASSERT_TRUE(real) ctest_assert_true(real, __FILE__, __LINE__)
 
 void assert_false(int real, const char* caller, int line);
-#define ASSERT_FALSE(real) assert_false(real, __FILE__, __LINE__)
+#define ASSERT_FALSE(real) ctest_assert_false(real, __FILE__, __LINE__)
 
 void assert_fail(const char* caller, int line);
 #define ASSERT_FAIL() assert_fail(__FILE__, __LINE__)
 
-void assert_dbl_compare(const char* cmp, double exp, double real, double tol, const char* caller, int line);
-#define ASSERT_DBL_NEAR(exp, real) assert_dbl_compare("==", exp, real, -CTEST_DBL_EPSILON, __FILE__, __LINE__)
-#define ASSERT_DBL_NEAR_TOL(exp, real, tol) assert_dbl_compare("==", exp, real, tol, __FILE__, __LINE__)
-#define ASSERT_DBL_FAR(exp, real) assert_dbl_compare("!=", exp, real, -CTEST_DBL_EPSILON, __FILE__, __LINE__)
-#define ASSERT_DBL_FAR_TOL(exp, real, tol) assert_dbl_compare("!=", exp, real, tol, __FILE__, __LINE__)
+// number of heap allocations so far, always 0 unless built with CTEST_MALLOC
+uint64_t ctest_alloc_count(void);
+void assert_no_alloc(uint64_t allocs_before, const char* caller, int line);
+#define ASSERT_NO_ALLOC(...) do { \
+        uint64_t ctest_allocs_before_ = ctest_alloc_count(); \
+        __VA_ARGS__; \
+        assert_no_alloc(ctest_allocs_before_, __FILE__, __LINE__); \
+    } while (0)
 
-#define ASSERT_FLT_NEAR(v1, v2) assert_dbl_compare("==", v1, v2, -CTEST_FLT_EPSILON, __FILE__, __LINE__)
-#define ASSERT_FLT_FAR(v1, v2) assert_dbl_compare("!=", v1, v2, -CTEST_FLT_EPSILON, __FILE__, __LINE__)
-#define ASSERT_DBL_LT(v1, v2) assert_dbl_compare("<", v1, v2, 0.0, __FILE__, __LINE__)
-#define ASSERT_DBL_GT(v1, v2) assert_dbl_compare(">", v1, v2, 0.0, __FILE__, __LINE__)
+#define ASSERT_DBL_NEAR(exp, real) ctest_assert_dbl(CTEST_CMP_EQ, exp, real, -CTEST_DBL_EPSILON, __FILE__, __LINE__)
+#define ASSERT_DBL_NEAR_TOL(exp, real, tol) ctest_assert_dbl(CTEST_CMP_EQ, exp, real, tol, __FILE__, __LINE__)
+#define ASSERT_DBL_FAR(exp, real) ctest_assert_dbl(CTEST_CMP_NE, exp, real, -CTEST_DBL_EPSILON, __FILE__, __LINE__)
+#define ASSERT_DBL_FAR_TOL(exp, real, tol) ctest_assert_dbl(CTEST_CMP_NE, exp, real, tol, __FILE__, __LINE__)
+
+#define ASSERT_FLT_NEAR(v1, v2) ctest_assert_dbl(CTEST_CMP_EQ, v1, v2, -CTEST_FLT_EPSILON, __FILE__, __LINE__)
+#define ASSERT_FLT_FAR(v1, v2) ctest_assert_dbl(CTEST_CMP_NE, v1, v2, -CTEST_FLT_EPSILON, __FILE__, __LINE__)
+#define ASSERT_DBL_LT(v1, v2) ctest_assert_dbl(CTEST_CMP_LT, v1, v2, 0.0, __FILE__, __LINE__)
+#define ASSERT_DBL_GT(v1, v2) ctest_assert_dbl(CTEST_CMP_GT, v1, v2, 0.0, __FILE__, __LINE__)
 
 #ifdef CTEST_MAIN
 
+/* the log, the worker pool and the counters are shared between threads and
+ * processes through the __atomic builtins of GCC and clang */
+#ifndef __GNUC__
+#error "CTEST_MAIN needs GCC or clang (the __atomic builtins)"
+#endif
+
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -257,16 +613,109 @@ void assert_dbl_compare(const char* cmp, double exp, double real, double tol, co
 #include <stdint.h>
 #include <stdlib.h>
 #include <wchar.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CTEST_IMPL_X86
+#include <immintrin.h>
+#endif
+/* The worker pool, --isolate, --timeout and --perf need POSIX and BSD
+ * functions that a strict (-std=c99) C library hides, unless ctest.h came
+ * first or the build defines _DEFAULT_SOURCE. Without them tests run serially */
+#if defined(__GLIBC__)
+#ifdef __USE_MISC
+#define CTEST_IMPL_POSIX
+#endif
+#elif !defined(_WIN32) || defined(__CYGWIN__)
+#if !defined(__STRICT_ANSI__) || defined(_DEFAULT_SOURCE) || defined(_BSD_SOURCE) || defined(_GNU_SOURCE) || defined(__APPLE__)
+#define CTEST_IMPL_POSIX
+#endif
+#endif
+#ifdef CTEST_IMPL_POSIX
+#define CTEST_IMPL_FORK
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#if defined(__GNUC__) && defined(__ELF__)
+/* only called from threads of the test, so only needed when they exist */
+#pragma weak pthread_kill
+#pragma weak pthread_key_create
+#pragma weak pthread_setspecific
+#endif
+#endif
+#if defined(__linux__) && defined(CTEST_IMPL_POSIX)
+#define CTEST_IMPL_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#ifndef _WIN32
+#define CTEST_IMPL_REGEX
+#include <regex.h>
+#endif
+
+#define MSG_SIZE 4096   // the longest message, and the log kept of a crashed worker
+#ifndef CTEST_LOG_MEMORY
+#define CTEST_LOG_MEMORY (1 << 20)  // the log past this goes to a temporary file
+#endif
+#define CTEST_LOG_CHUNKS 32     // chunk k holds MSG_SIZE << k bytes
+// The output of the running test, without colors. Messages are formatted in
+// a per-thread line, then a range of the log is claimed with a fetch-and-add
+// and the line copied into it, so the threads of a test can log and assert
+// concurrently. The log is kept in chunks that never move: the first is
+// ctest_errorfirst, the others are allocated when the log reaches them.
+static char ctest_errorstorage[MSG_SIZE];
+static char* ctest_errorfirst = ctest_errorstorage;
+static char* ctest_errorchunks[CTEST_LOG_CHUNKS];
+static size_t ctest_errorused;
+static char* ctest_errortext;       // the log in one piece, see ctest_log_text()
+#ifdef CTEST_IMPL_FORK
+static FILE* ctest_errorspill;      // the log past CTEST_LOG_MEMORY, at the same offsets
+static void* ctest_errormap;        // the spilled log, mapped to report it
+// A serial --timeout jumps out of the test from the SIGALRM handler. That's
+// not safe in the middle of a log call, which may be in malloc or tmpfile, so
+// the first alarm only sets ctest_timeout_pending and the jump is made at the
+// end of the next log call. See ctest_sigalrm()
+static sigjmp_buf ctest_timeout_jmp;
+static volatile sig_atomic_t ctest_timeout_pending;
+static CTEST_IMPL_THREAD_LOCAL volatile sig_atomic_t ctest_in_log;
+#endif
+
+#if defined(CTEST_MALLOC) && !defined(__GLIBC__)
+#warning "CTEST_MALLOC needs glibc, heap accounting is disabled"
+#undef CTEST_MALLOC
+#endif
 
-static size_t ctest_errorsize;
-static char* ctest_errormsg;
-#define MSG_SIZE 4096
-static char ctest_errorbuffer[MSG_SIZE];
+#ifdef CTEST_MALLOC
+// the real allocator, glibc exports it under these names. ctest's own
+// buffers come from it directly, they aren't the allocations of the test
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t nmemb, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void* __libc_valloc(size_t size);
+void* __libc_pvalloc(size_t size);
+void __libc_free(void* ptr);
+#define CTEST_IMPL_MALLOC __libc_malloc
+#define CTEST_IMPL_FREE __libc_free
+#else
+#define CTEST_IMPL_MALLOC malloc
+#define CTEST_IMPL_FREE free
+#endif
+// set while the C library allocates for ctest, e.g. in tmpfile()
+static CTEST_IMPL_THREAD_LOCAL int ctest_heap_internal;
+static CTEST_IMPL_THREAD_LOCAL char ctest_line[MSG_SIZE];
+static CTEST_IMPL_THREAD_LOCAL size_t ctest_errorsize;
+static CTEST_IMPL_THREAD_LOCAL char* ctest_errormsg;
+static CTEST_IMPL_THREAD_LOCAL int ctest_is_runner;    // the thread that runs the tests
+static int ctest_thread_failures;   // failed assertions in other threads of the test
 static jmp_buf ctest_err;
 static int color_output = 1;
-static const char* suite_name;
-
-typedef int (*ctest_filter_func)(struct ctest*);
 
 #define ANSI_BLACK    "\033[0;30m"
 #define ANSI_RED      "\033[0;31m"
@@ -286,8 +735,21 @@ typedef int (*ctest_filter_func)(struct ctest*);
 #define ANSI_WHITE    "\033[01;37m"
 #define ANSI_NORMAL   "\033[0m"
 
+// makes sure the section exists, even without tests
 CTEST(suite, test) { }
 
+#if defined(__APPLE__)
+extern struct ctest ctest_section_start __asm("section$start$__DATA$.ctest");
+extern struct ctest ctest_section_stop __asm("section$end$__DATA$.ctest");
+#define CTEST_IMPL_SECTION_BOUNDS
+#elif defined(__ELF__)
+extern struct ctest __start_ctest;
+extern struct ctest __stop_ctest;
+#define ctest_section_start __start_ctest
+#define ctest_section_stop __stop_ctest
+#define CTEST_IMPL_SECTION_BOUNDS
+#endif
+
 static void vprint_errormsg(const char* const fmt, va_list ap) CTEST_IMPL_FORMAT_PRINTF(1, 0);
 static void print_errormsg(const char* const fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2);
 
@@ -298,8 +760,8 @@ static void vprint_errormsg(const char* const fmt, va_list ap) {
         ctest_errormsg[0] = 0x00;
     } else {
         const size_t size = (size_t) ret;
-        const size_t s = (ctest_errorsize <= size ? size -ctest_errorsize : size);
-        // ctest_errorsize may overflow at this point
+        // stop at the end of the line when the message was truncated
+        const size_t s = (size < ctest_errorsize ? size : ctest_errorsize - 1);
         ctest_errorsize -= s;
         ctest_errormsg += s;
     }
@@ -312,24 +774,172 @@ static void print_errormsg(const char* const fmt, ...) {
     va_end(argp);
 }
 
-static void msg_start(const char* color, const char* title) {
-    if (color_output) {
-        print_errormsg("%s", color);
-    }
+static void msg_start(const char* title) {
+#ifdef CTEST_IMPL_FORK
+    ctest_in_log = 1;
+#endif
+    ctest_errormsg = ctest_line;
+    ctest_errorsize = MSG_SIZE;
+    ctest_line[0] = 0;
     print_errormsg("  %s: ", title);
 }
 
-static void msg_end(void) {
-    if (color_output) {
-        print_errormsg(ANSI_NORMAL);
+// chunk k of the log, whichever thread gets there first allocates it
+static char* ctest_log_chunk(int k) {
+    if (k == 0) return ctest_errorfirst;
+    char* chunk = __atomic_load_n(&ctest_errorchunks[k], __ATOMIC_ACQUIRE);
+    if (chunk) return chunk;
+    char* fresh = (char*) CTEST_IMPL_MALLOC((size_t) MSG_SIZE << k);
+    if (fresh == NULL) return NULL;
+    if (__atomic_compare_exchange_n(&ctest_errorchunks[k], &chunk, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return fresh;
+    CTEST_IMPL_FREE(fresh);
+    return chunk;
+}
+
+#ifdef CTEST_IMPL_FORK
+static FILE* ctest_log_spill(void) {
+    FILE* spill = __atomic_load_n(&ctest_errorspill, __ATOMIC_ACQUIRE);
+    if (spill) return spill;
+    ctest_heap_internal++;
+    FILE* fresh = tmpfile();
+    if (fresh && !__atomic_compare_exchange_n(&ctest_errorspill, &spill, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        fclose(fresh);
+        fresh = spill;
+    }
+    ctest_heap_internal--;
+    return fresh;
+}
+#endif
+
+// copies len bytes to offset off of the log: into the chunks it lands in, or
+// the spill file past CTEST_LOG_MEMORY
+static void ctest_log_write(size_t off, const char* msg, size_t len) {
+    size_t base = 0;
+    size_t size = MSG_SIZE;
+    int k;
+#ifdef CTEST_IMPL_FORK
+    if (off + len > CTEST_LOG_MEMORY) {
+        size_t in_memory = off < CTEST_LOG_MEMORY ? CTEST_LOG_MEMORY - off : 0;
+        FILE* spill = ctest_log_spill();
+        if (spill) {
+            ssize_t r = pwrite(fileno(spill), msg + in_memory, len - in_memory, (off_t) (off + in_memory));
+            (void) r;
+        }
+        len = in_memory;
+    }
+#endif
+    for (k = 0; len > 0 && k < CTEST_LOG_CHUNKS; k++) {
+        if (off < base + size) {
+            size_t n = base + size - off < len ? base + size - off : len;
+            char* chunk = ctest_log_chunk(k);
+            if (chunk) memcpy(chunk + (off - base), msg, n);
+            off += n;
+            msg += n;
+            len -= n;
+        }
+        base += size;
+        size *= 2;
     }
+}
+
+static void msg_end(void) {
     print_errormsg("\n");
+    size_t len = (size_t) (ctest_errormsg - ctest_line);
+    size_t off = __atomic_fetch_add(&ctest_errorused, len, __ATOMIC_RELAXED);
+    ctest_log_write(off, ctest_line, len);
+#ifdef CTEST_IMPL_FORK
+    ctest_in_log = 0;
+    if (ctest_timeout_pending && ctest_is_runner) siglongjmp(ctest_timeout_jmp, 1);
+#endif
+}
+
+static void ctest_log_reset(void) {
+    size_t used = ctest_errorused < MSG_SIZE ? ctest_errorused : MSG_SIZE;
+    int k;
+    // zeroed so the log of a crashed worker ends at the last complete message
+    memset(ctest_errorfirst, 0, used ? used : 1);
+    for (k = 1; k < CTEST_LOG_CHUNKS; k++) {
+        CTEST_IMPL_FREE(ctest_errorchunks[k]);
+        ctest_errorchunks[k] = NULL;
+    }
+    CTEST_IMPL_FREE(ctest_errortext);
+    ctest_errortext = NULL;
+#ifdef CTEST_IMPL_FORK
+    if (ctest_errormap) munmap(ctest_errormap, ctest_errorused);
+    ctest_heap_internal++;
+    if (ctest_errorspill) fclose(ctest_errorspill);
+    ctest_heap_internal--;
+    ctest_errormap = NULL;
+    ctest_errorspill = NULL;
+#endif
+    ctest_errorused = 0;
+}
+
+// copies the first len bytes of the log in memory to dst
+static void ctest_log_gather(char* dst, size_t len) {
+    size_t base = 0;
+    size_t size = MSG_SIZE;
+    int k;
+    for (k = 0; base < len && k < CTEST_LOG_CHUNKS; k++) {
+        size_t n = len - base < size ? len - base : size;
+        const char* chunk = k == 0 ? ctest_errorfirst : ctest_errorchunks[k];
+        if (chunk) memcpy(dst + base, chunk, n);
+        else memset(dst + base, 0, n);
+        base += size;
+        size *= 2;
+    }
+}
+
+// returns the log and its length, once the threads of the test are done
+static const char* ctest_log_text(size_t* len) {
+    *len = __atomic_load_n(&ctest_errorused, __ATOMIC_ACQUIRE);
+    if (*len < MSG_SIZE) {
+        ctest_errorfirst[*len] = 0;
+        return ctest_errorfirst;
+    }
+#ifdef CTEST_IMPL_FORK
+    if (ctest_errorspill) {
+        // the start of the file is left for the part in memory
+        char* head = (char*) CTEST_IMPL_MALLOC(CTEST_LOG_MEMORY);
+        int fd = fileno(ctest_errorspill);
+        if (head) {
+            ctest_log_gather(head, CTEST_LOG_MEMORY);
+            ssize_t r = pwrite(fd, head, CTEST_LOG_MEMORY, 0);
+            (void) r;
+            CTEST_IMPL_FREE(head);
+        }
+        ctest_errormap = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ctest_errormap != MAP_FAILED) return (const char*) ctest_errormap;
+        ctest_errormap = NULL;
+        *len = 0;
+        return "";
+    }
+#endif
+    CTEST_IMPL_FREE(ctest_errortext);
+    ctest_errortext = (char*) CTEST_IMPL_MALLOC(*len + 1);
+    if (ctest_errortext == NULL) {
+        *len = MSG_SIZE - 1;
+        ctest_errorfirst[*len] = 0;
+        return ctest_errorfirst;
+    }
+    ctest_log_gather(ctest_errortext, *len);
+    ctest_errortext[*len] = 0;
+    return ctest_errortext;
 }
 
-void CTEST_LOG(const char* fmt, ...)
+// drops the log written after mark, the runs of a property that passed
+static void ctest_log_truncate(size_t mark) {
+    if (mark < MSG_SIZE && mark < ctest_errorused) {
+        size_t end = ctest_errorused < MSG_SIZE ? ctest_errorused : MSG_SIZE;
+        memset(ctest_errorfirst + mark, 0, end - mark);
+    }
+    if (mark < ctest_errorused) ctest_errorused = mark;
+}
+
+void ctest_log(int level, const char* fmt, ...)
 {
     va_list argp;
-    msg_start(ANSI_BLUE, "LOG");
+    msg_start(level == CTEST_LOG_DEBUG ? "DEBUG" : "LOG");
 
     va_start(argp, fmt);
     vprint_errormsg(fmt, argp);
@@ -343,19 +953,26 @@ CTEST_IMPL_DIAG_PUSH_IGNORED(missing-noreturn)
 void CTEST_ERR(const char* fmt, ...)
 {
     va_list argp;
-    msg_start(ANSI_YELLOW, "ERR");
+    msg_start("ERR");
 
     va_start(argp, fmt);
     vprint_errormsg(fmt, argp);
     va_end(argp);
 
     msg_end();
+    if (!ctest_is_runner) {
+        // another thread can't jump to the runner, and ending it could leave
+        // its locks held. It goes on, the test fails when it ends
+        __atomic_fetch_add(&ctest_thread_failures, 1, __ATOMIC_RELEASE);
+        return;
+    }
     longjmp(ctest_err, 1);
 }
 
 CTEST_IMPL_DIAG_POP()
 
 void assert_str(const char* cmp, const char* exp, const char*  real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
     if ((!exp ^ !real) || (exp && (
         (cmp[1] == '=' && ((cmp[0] == '=') ^ (strcmp(exp, real) == 0))) ||
         (cmp[1] == '~' && ((cmp[0] == '=') ^ (strstr(exp, real) != NULL)))
@@ -365,6 +982,7 @@ void assert_str(const char* cmp, const char* exp, const char*  real, const char*
 }
 
 void assert_wstr(const char* cmp, const wchar_t *exp, const wchar_t *real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
     if ((!exp ^ !real) || (exp && (
         (cmp[1] == '=' && ((cmp[0] == '=') ^ (wcscmp(exp, real) == 0))) ||
         (cmp[1] == '~' && ((cmp[0] == '=') ^ (wcsstr(exp, real) != NULL)))
@@ -373,19 +991,232 @@ void assert_wstr(const char* cmp, const wchar_t *exp, const wchar_t *real, const
     }
 }
 
+// returns the offset of the first differing byte, or size if equal
+static size_t ctest_mismatch_scalar(const unsigned char* a, const unsigned char* b, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        if (wa != wb) break;
+    }
+    while (i < size && a[i] == b[i]) i++;
+    return i;
+}
+
+static size_t ctest_count_diff_scalar(const unsigned char* a, const unsigned char* b, size_t size) {
+    size_t i, count = 0;
+    for (i = 0; i < size; i++) count += (a[i] != b[i]);
+    return count;
+}
+
+#ifdef CTEST_IMPL_X86
+#ifdef __SSE2__
+static size_t ctest_mismatch_sse2(const unsigned char* a, const unsigned char* b, size_t size) {
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i)), _mm_loadu_si128((const __m128i*) (b + i)));
+        unsigned mask = (unsigned) _mm_movemask_epi8(eq);
+        if (mask != 0xffffu) return i + (size_t) __builtin_ctz(~mask);
+    }
+    return i + ctest_mismatch_scalar(a + i, b + i, size - i);
+}
+
+static size_t ctest_count_diff(const unsigned char* a, const unsigned char* b, size_t size) {
+    size_t i = 0, count = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i)), _mm_loadu_si128((const __m128i*) (b + i)));
+        count += 16 - (size_t) __builtin_popcount((unsigned) _mm_movemask_epi8(eq));
+    }
+    return count + ctest_count_diff_scalar(a + i, b + i, size - i);
+}
+#else
+#define ctest_mismatch_sse2 ctest_mismatch_scalar
+#define ctest_count_diff ctest_count_diff_scalar
+#endif
+
+__attribute__((target("avx2")))
+static size_t ctest_mismatch_avx2(const unsigned char* a, const unsigned char* b, size_t size) {
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + i)), _mm256_loadu_si256((const __m256i*) (b + i)));
+        __m256i eq2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + i + 32)), _mm256_loadu_si256((const __m256i*) (b + i + 32)));
+        if ((unsigned) _mm256_movemask_epi8(_mm256_and_si256(eq1, eq2)) != 0xffffffffu) break;
+    }
+    for (; i + 32 <= size; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + i)), _mm256_loadu_si256((const __m256i*) (b + i)));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(eq);
+        if (mask != 0xffffffffu) return i + (size_t) __builtin_ctz(~mask);
+    }
+    return i + ctest_mismatch_scalar(a + i, b + i, size - i);
+}
+
+static size_t ctest_mismatch(const unsigned char* a, const unsigned char* b, size_t size) {
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        __builtin_cpu_init();
+        has_avx2 = __builtin_cpu_supports("avx2") != 0;
+    }
+    return has_avx2 ? ctest_mismatch_avx2(a, b, size) : ctest_mismatch_sse2(a, b, size);
+}
+#else
+#define ctest_mismatch ctest_mismatch_scalar
+#define ctest_count_diff ctest_count_diff_scalar
+#endif
+
+// hex dump of the rows around offset, with the differing bytes marked
+static void ctest_hexdump_diff(char* out, size_t outsize, const unsigned char* exp,
+                               const unsigned char* real, size_t size, size_t offset) {
+    size_t row = (offset & ~(size_t) 15) >= 16 ? (offset & ~(size_t) 15) - 16 : 0;
+    size_t end = row + 48 < size ? row + 48 : size;
+    size_t len = 0;
+    out[0] = 0;
+    for (; row < end && len < outsize; row += 16) {
+        size_t i;
+        size_t n = end - row < 16 ? end - row : 16;
+        char marks[16 * 3 + 1];
+        len += (size_t) snprintf(out + len, outsize - len, "\n    exp %08" PRIxMAX ":", (uintmax_t) row);
+        for (i = 0; i < n && len < outsize; i++) len += (size_t) snprintf(out + len, outsize - len, " %02x", exp[row + i]);
+        if (len >= outsize) break;
+        len += (size_t) snprintf(out + len, outsize - len, "\n    got %08" PRIxMAX ":", (uintmax_t) row);
+        for (i = 0; i < n && len < outsize; i++) len += (size_t) snprintf(out + len, outsize - len, " %02x", real[row + i]);
+        if (len >= outsize) break;
+        memset(marks, ' ', sizeof(marks));
+        for (i = 0; i < n; i++) {
+            if (exp[row + i] != real[row + i]) marks[i * 3 + 1] = marks[i * 3 + 2] = '^';
+        }
+        for (i = 3 * n; i > 0 && marks[i - 1] == ' '; i--) {}
+        marks[i] = 0;
+        if (i) len += (size_t) snprintf(out + len, outsize - len, "\n                 %s", marks);
+    }
+}
+
+// describes the first difference of exp and real in out, returns 0 if there is none
+static int ctest_describe_diff(char* out, size_t outsize, const unsigned char* exp,
+                               const unsigned char* real, size_t size) {
+    size_t offset = ctest_mismatch(exp, real, size);
+    if (offset == size) return 0;
+    char dump[1024];
+    size_t count = 1 + ctest_count_diff(exp + offset + 1, real + offset + 1, size - offset - 1);
+    ctest_hexdump_diff(dump, sizeof(dump), exp, real, size, offset);
+    snprintf(out, outsize, "expected 0x%02x at offset %" PRIuMAX " got 0x%02x (%" PRIuMAX " of %" PRIuMAX " bytes differ)%s",
+             exp[offset], (uintmax_t) offset, real[offset], (uintmax_t) count, (uintmax_t) size, dump);
+    return 1;
+}
+
 void assert_data(const unsigned char* exp, size_t expsize,
                  const unsigned char* real, size_t realsize,
                  const char* caller, int line) {
-    size_t i;
+    CTEST_IMPL_COUNT_ASSERT();
+    char msg[1200];
     if (expsize != realsize) {
         CTEST_ERR("%s:%d  expected %" PRIuMAX " bytes, got %" PRIuMAX, caller, line, (uintmax_t) expsize, (uintmax_t) realsize);
+        return;
+    }
+    if (ctest_describe_diff(msg, sizeof(msg), exp, real, expsize)) {
+        CTEST_ERR("%s:%d %s", caller, line, msg);
+    }
+}
+
+// the whole file, mapped where possible so it isn't read before it's used
+static void* ctest_map_file(const char* filename, size_t* size) {
+    static char empty[1];
+    void* data = NULL;
+#ifdef CTEST_IMPL_FORK
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) == 0) {
+        *size = (size_t) st.st_size;
+        data = *size ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : empty;
+        if (data == MAP_FAILED) data = NULL;
+#ifdef MADV_SEQUENTIAL
+        else if (*size) madvise(data, *size, MADV_SEQUENTIAL);
+#endif
     }
-    for (i=0; i<expsize; i++) {
-        if (exp[i] != real[i]) {
-            CTEST_ERR("%s:%d expected 0x%02x at offset %" PRIuMAX " got 0x%02x",
-                caller, line, exp[i], (uintmax_t) i, real[i]);
+    close(fd);
+#else
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) return NULL;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        long len = ftell(f);
+        *size = len > 0 ? (size_t) len : 0;
+        data = *size ? malloc(*size) : empty;
+        rewind(f);
+        if (data && *size && fread(data, 1, *size, f) != *size) {
+            free(data);
+            data = NULL;
         }
     }
+    fclose(f);
+#endif
+    return data;
+}
+
+static void ctest_unmap_file(void* data, size_t size) {
+    if (data == NULL || size == 0) return;
+#ifdef CTEST_IMPL_FORK
+    munmap(data, size);
+#else
+    free(data);
+#endif
+}
+
+// writes a new file next to the old one and renames it, readers never see half a file
+static int ctest_replace_file(const char* filename, const void* data, size_t size) {
+    size_t len = strlen(filename);
+    char* tmpname = (char*) malloc(len + 5);
+    if (tmpname == NULL) return -1;
+    memcpy(tmpname, filename, len);
+    memcpy(tmpname + len, ".tmp", 5);
+    FILE* f = fopen(tmpname, "wb");
+    int ok = f != NULL;
+    if (ok && size) ok = fwrite(data, 1, size, f) == size;
+    if (f && fclose(f) != 0) ok = 0;
+#ifdef _WIN32
+    if (ok) remove(filename);
+#endif
+    if (ok) ok = rename(tmpname, filename) == 0;
+    if (!ok) remove(tmpname);
+    free(tmpname);
+    return ok ? 0 : -1;
+}
+
+static int ctest_update_golden;     // --update-golden
+
+void assert_data_file(const char* path, const unsigned char* real, size_t realsize, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    char msg[1200];
+    size_t size = 0;
+    const unsigned char* exp = (const unsigned char*) ctest_map_file(path, &size);
+    int differs = exp == NULL || size != realsize || ctest_describe_diff(msg, sizeof(msg), exp, real, size);
+    if (differs && ctest_update_golden) {
+        ctest_unmap_file((void*) (uintptr_t) exp, size);
+        if (ctest_replace_file(path, real, realsize) != 0) CTEST_ERR("%s:%d  cannot write '%s'", caller, line, path);
+        else ctest_log(CTEST_LOG_INFO, "updated '%s'", path);
+        return;
+    }
+    if (exp == NULL) {
+        CTEST_ERR("%s:%d  cannot read '%s', use --update-golden to create it", caller, line, path);
+        return;
+    }
+    if (differs && size != realsize) {
+        // report the first difference, or that one is a prefix of the other
+        size_t common = size < realsize ? size : realsize;
+        int len = snprintf(msg, sizeof(msg), "expected %" PRIuMAX " bytes, got %" PRIuMAX, (uintmax_t) size, (uintmax_t) realsize);
+        char* diff = msg + len;
+        if (ctest_describe_diff(diff + 2, sizeof(msg) - (size_t) len - 2, exp, real, common)) memcpy(diff, ", ", 2);
+    }
+    ctest_unmap_file((void*) (uintptr_t) exp, size);
+    if (differs) CTEST_ERR("%s:%d  '%s': %s", caller, line, path, msg);
+}
+
+void assert_str_file(const char* path, const char* real, const char* caller, int line) {
+    if (real == NULL) {
+        CTEST_ERR("%s:%d  expected the contents of '%s', got NULL", caller, line, path);
+        return;
+    }
+    assert_data_file(path, (const unsigned char*) real, strlen(real), caller, line);
 }
 
 static bool get_compare_result(const char* cmp, int c3, bool eq) {
@@ -397,6 +1228,7 @@ static bool get_compare_result(const char* cmp, int c3, bool eq) {
 }
 
 void assert_compare(const char* cmp, intmax_t exp, intmax_t real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
     int c3 = (real < exp) - (exp < real);
 
     if (!get_compare_result(cmp, c3, c3 == 0)) {
@@ -405,6 +1237,7 @@ void assert_compare(const char* cmp, intmax_t exp, intmax_t real, const char* ca
 }
 
 void assert_compare_u(const char* cmp, uintmax_t exp, uintmax_t real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
     int c3 = (real < exp) - (exp < real);
 
     if (!get_compare_result(cmp, c3, c3 == 0)) {
@@ -413,6 +1246,7 @@ void assert_compare_u(const char* cmp, uintmax_t exp, uintmax_t real, const char
 }
 
 void assert_interval(intmax_t exp1, intmax_t exp2, intmax_t real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
     if (real < exp1 || real > exp2) {
         CTEST_ERR("%s:%d  expected %" PRIdMAX "-%" PRIdMAX ", got %" PRIdMAX, caller, line, exp1, exp2, real);
     }
@@ -428,6 +1262,7 @@ static bool approximately_equal(double a, double b, double epsilon) {
 
 /* tol < 0 means it is an epsilon, else absolute error */
 void assert_dbl_compare(const char* cmp, double exp, double real, double tol, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
     double diff = exp - real;
     double absdiff = diff < 0 ? -diff : diff;
     int c3 = (real < exp) - (exp < real);
@@ -443,104 +1278,652 @@ void assert_dbl_compare(const char* cmp, double exp, double real, double tol, co
     }
 }
 
+CTEST_IMPL_THREAD_LOCAL uint64_t ctest_assert_count;
+CTEST_IMPL_THREAD_LOCAL int ctest_assert_thread;
+static uint64_t ctest_thread_asserts;   // of the threads of the test that exited
+#ifdef CTEST_IMPL_FORK
+static pthread_key_t ctest_thread_key;
+static int ctest_thread_key_ok;
+
+static void ctest_thread_exit(void* count) {
+    __atomic_fetch_add(&ctest_thread_asserts, *(uint64_t*) count, __ATOMIC_RELAXED);
+}
+#endif
+
+int ctest_count_thread(void) {
+#ifdef CTEST_IMPL_FORK
+    if (!ctest_is_runner && ctest_thread_key_ok) pthread_setspecific(ctest_thread_key, &ctest_assert_count);
+#endif
+    return 1;
+}
+
+// the runner's asserts and those of the threads it joined
+static uint64_t ctest_test_asserts(void) {
+    return ctest_assert_count + __atomic_load_n(&ctest_thread_asserts, __ATOMIC_RELAXED);
+}
+
+static const char* const ctest_cmp_names[] = { "==", "!=", "<", "<=", ">", ">=" };
+
+void ctest_fail_compare(enum ctest_cmp cmp, intmax_t exp, intmax_t real, const char* caller, int line) {
+    CTEST_ERR("%s:%d  assertion failed, %" PRIdMAX " %s %" PRIdMAX, caller, line, exp, ctest_cmp_names[cmp], real);
+}
+
+void ctest_fail_compare_u(enum ctest_cmp cmp, uintmax_t exp, uintmax_t real, const char* caller, int line) {
+    CTEST_ERR("%s:%d  assertion failed, %" PRIuMAX " %s %" PRIuMAX, caller, line, exp, ctest_cmp_names[cmp], real);
+}
+
+void ctest_fail_values(enum ctest_cmp cmp, const char* exp, const char* real, const char* caller, int line) {
+    CTEST_ERR("%s:%d  assertion failed, %s %s %s", caller, line, exp, ctest_cmp_names[cmp], real);
+}
+
+void ctest_fail_interval(intmax_t exp1, intmax_t exp2, intmax_t real, const char* caller, int line) {
+    CTEST_ERR("%s:%d  expected %" PRIdMAX "-%" PRIdMAX ", got %" PRIdMAX, caller, line, exp1, exp2, real);
+}
+
+void ctest_fail_dbl(enum ctest_cmp cmp, double exp, double real, double tol, const char* caller, int line) {
+    const char* tolstr = tol < 0 ? "eps" : "tol";
+    CTEST_ERR("%s:%d  assertion failed, %.8g %s %.8g (diff %.4g, %s %.4g)", caller, line, exp,
+              ctest_cmp_names[cmp], real, exp - real, tolstr, tol < 0 ? -tol : tol);
+}
+
+void ctest_fail_msg(const char* msg, const char* caller, int line) {
+    CTEST_ERR("%s:%d  %s", caller, line, msg);
+}
+
 void assert_null(void* real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
     if ((real) != NULL) {
         CTEST_ERR("%s:%d  should be NULL", caller, line);
     }
 }
 
 void assert_not_null(const void* real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
     if (real == NULL) {
         CTEST_ERR("%s:%d  should not be NULL", caller, line);
     }
 }
 
 void assert_true(int real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
     if ((real) == 0) {
         CTEST_ERR("%s:%d  should be true", caller, line);
     }
 }
 
 void assert_false(int real, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
     if ((real) != 0) {
         CTEST_ERR("%s:%d  should be false", caller, line);
     }
 }
 
 void assert_fail(const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
     CTEST_ERR("%s:%d  shouldn't come here", caller, line);
 }
 
+struct ctest_heap_stats {
+    uint64_t allocs;
+    uint64_t bytes;         // requested
+};
 
-static int suite_all(struct ctest* t) {
-    (void) t; // fix unused parameter warning
-    return 1;
-}
-
-static int suite_filter(struct ctest* t) {
-    return strncmp(suite_name, t->ssname, strlen(suite_name)) == 0;
-}
+static struct ctest_heap_stats ctest_heap;
 
-static void color_print(const char* color, const char* text) {
-    if (color_output)
-        printf("%s%s" ANSI_NORMAL "\n", color, text);
-    else
-        printf("%s\n", text);
-}
+#ifdef CTEST_MALLOC
+#include <errno.h>
+#include <malloc.h>
 
-#ifdef CTEST_SEGFAULT
-#include <signal.h>
-#if !defined(_WIN32) || defined(__CYGWIN__)
-// kill has no nice include somehow
-#include <sys/types.h>
-int kill(pid_t pid, int sig);
+// the exception specification has to match glibc's declarations in C++
+#ifdef __cplusplus
+#define CTEST_IMPL_MALLOC_THROW __THROW
+#else
+#define CTEST_IMPL_MALLOC_THROW
 #endif
-static void sighandler(int signum)
-{
-    const char msg_color[] = ANSI_BRED "[SIGSEGV: Segmentation fault]" ANSI_NORMAL "\n";
-    const char msg_nocolor[] = "[SIGSEGV: Segmentation fault]\n";
 
-    const char* msg = color_output ? msg_color : msg_nocolor;
-    write(STDOUT_FILENO, msg, (unsigned int)strlen(msg));
+// The blocks the running test allocated and didn't free yet, with their
+// requested size. Only these are its leaks, so freeing a block it didn't
+// allocate (one of its suite setup) doesn't hide one. A hash table with
+// linear probing, behind a spinlock since the threads of the test allocate too
+struct ctest_heap_block {
+    void* ptr;      // NULL if the slot is free
+    size_t size;
+};
+#define CTEST_HEAP_SLOTS 1024   // the table starts at this size, and shrinks back to it
+static struct ctest_heap_block* ctest_heap_blocks;
+static size_t ctest_heap_slots;     // a power of 2, or 0
+static size_t ctest_heap_live;
+static uint64_t ctest_heap_live_bytes;
+static int ctest_heap_tracking;     // from the setup of a test to its teardown
+static bool ctest_heap_locked;
 
-    /* "Unregister" the signal handler and send the signal back to the process
-     * so it can terminate as expected */
-    signal(signum, SIG_DFL);
-#if !defined(_WIN32) || defined(__CYGWIN__)
-    kill(getpid(), signum);
-#endif
+static void ctest_heap_lock(void) {
+    while (__atomic_test_and_set(&ctest_heap_locked, __ATOMIC_ACQUIRE)) continue;
 }
-#endif
 
-int ctest_main(int argc, const char *argv[]);
+static void ctest_heap_unlock(void) {
+    __atomic_clear(&ctest_heap_locked, __ATOMIC_RELEASE);
+}
 
-__attribute__((no_sanitize_address)) int ctest_main(int argc, const char *argv[])
-{
-    static int total = 0;
-    static int num_ok = 0;
-    static int num_fail = 0;
-    static int num_skip = 0;
-    static int idx = 1;
-    static ctest_filter_func filter = suite_all;
+static size_t ctest_heap_slot(const void* ptr) {
+    return (size_t) (((uint64_t) (uintptr_t) ptr * 0x9E3779B97F4A7C15u) >> 32) & (ctest_heap_slots - 1);
+}
 
-#ifdef CTEST_SEGFAULT
-    signal(SIGSEGV, sighandler);
+static void ctest_heap_put(void* ptr, size_t size) {
+    size_t i = ctest_heap_slot(ptr);
+    while (ctest_heap_blocks[i].ptr) i = (i + 1) & (ctest_heap_slots - 1);
+    ctest_heap_blocks[i].ptr = ptr;
+    ctest_heap_blocks[i].size = size;
+}
+
+// a block the table has no room for isn't tracked
+static void ctest_heap_track(void* ptr, size_t size) {
+    size_t i;
+    ctest_heap_lock();
+    if (2 * (ctest_heap_live + 1) > ctest_heap_slots) {
+        struct ctest_heap_block* old = ctest_heap_blocks;
+        size_t old_slots = ctest_heap_slots;
+        size_t slots = old_slots ? 2 * old_slots : CTEST_HEAP_SLOTS;
+        struct ctest_heap_block* blocks = (struct ctest_heap_block*) __libc_calloc(slots, sizeof(struct ctest_heap_block));
+        if (blocks == NULL) {
+            ctest_heap_unlock();
+            return;
+        }
+        ctest_heap_blocks = blocks;
+        ctest_heap_slots = slots;
+        for (i = 0; i < old_slots; i++) {
+            if (old[i].ptr) ctest_heap_put(old[i].ptr, old[i].size);
+        }
+        __libc_free(old);
+    }
+    ctest_heap_put(ptr, size);
+    ctest_heap_live++;
+    ctest_heap_live_bytes += size;
+    ctest_heap_unlock();
+}
+
+// removes ptr if the test allocated it, returns whether it did
+static int ctest_heap_untrack(void* ptr, size_t* size) {
+    int found = 0;
+    ctest_heap_lock();
+    if (ctest_heap_live > 0) {
+        size_t mask = ctest_heap_slots - 1;
+        size_t i = ctest_heap_slot(ptr);
+        size_t j;
+        while (ctest_heap_blocks[i].ptr && ctest_heap_blocks[i].ptr != ptr) i = (i + 1) & mask;
+        if (ctest_heap_blocks[i].ptr) {
+            found = 1;
+            *size = ctest_heap_blocks[i].size;
+            ctest_heap_live--;
+            ctest_heap_live_bytes -= *size;
+            // moves back the blocks after it that can't be found past the hole
+            for (j = (i + 1) & mask; ctest_heap_blocks[j].ptr; j = (j + 1) & mask) {
+                size_t home = ctest_heap_slot(ctest_heap_blocks[j].ptr);
+                if (((j - home) & mask) < ((j - i) & mask)) continue;
+                ctest_heap_blocks[i] = ctest_heap_blocks[j];
+                i = j;
+            }
+            ctest_heap_blocks[i].ptr = NULL;
+        }
+    }
+    ctest_heap_unlock();
+    return found;
+}
+
+static int ctest_heap_tracked(void) {
+    return !ctest_heap_internal && __atomic_load_n(&ctest_heap_tracking, __ATOMIC_RELAXED);
+}
+
+// owned: the test allocated it, not a resize of someone else's block
+static void ctest_heap_alloced(void* ptr, size_t size, int owned) {
+    if (ptr == NULL || ctest_heap_internal) return;
+    __atomic_fetch_add(&ctest_heap.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ctest_heap.bytes, size, __ATOMIC_RELAXED);
+    if (owned && ctest_heap_tracked()) ctest_heap_track(ptr, size);
+}
+
+void* malloc(size_t size) CTEST_IMPL_MALLOC_THROW {
+    void* ptr = __libc_malloc(size);
+    ctest_heap_alloced(ptr, size, 1);
+    return ptr;
+}
+
+void* calloc(size_t nmemb, size_t size) CTEST_IMPL_MALLOC_THROW {
+    void* ptr = __libc_calloc(nmemb, size);
+    ctest_heap_alloced(ptr, nmemb * size, 1);
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) CTEST_IMPL_MALLOC_THROW {
+    size_t old_size = 0;
+    // forgotten first, another thread may get the address once it's freed
+    int owned = ptr == NULL || (ctest_heap_tracked() && ctest_heap_untrack(ptr, &old_size));
+    void* new_ptr = __libc_realloc(ptr, size);
+    if (new_ptr == NULL && size != 0) {
+        // the old block is untouched
+        if (ptr && owned) ctest_heap_track(ptr, old_size);
+        return NULL;
+    }
+    ctest_heap_alloced(new_ptr, size, owned);
+    return new_ptr;
+}
+
+void* memalign(size_t alignment, size_t size) CTEST_IMPL_MALLOC_THROW {
+    void* ptr = __libc_memalign(alignment, size);
+    ctest_heap_alloced(ptr, size, 1);
+    return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) CTEST_IMPL_MALLOC_THROW {
+    void* ptr = __libc_memalign(alignment, size);
+    ctest_heap_alloced(ptr, size, 1);
+    return ptr;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) CTEST_IMPL_MALLOC_THROW {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+    void* ptr = __libc_memalign(alignment, size);
+    if (ptr == NULL) return ENOMEM;
+    ctest_heap_alloced(ptr, size, 1);
+    *memptr = ptr;
+    return 0;
+}
+
+void* valloc(size_t size) CTEST_IMPL_MALLOC_THROW {
+    void* ptr = __libc_valloc(size);
+    ctest_heap_alloced(ptr, size, 1);
+    return ptr;
+}
+
+void* pvalloc(size_t size) CTEST_IMPL_MALLOC_THROW {
+    void* ptr = __libc_pvalloc(size);
+    ctest_heap_alloced(ptr, size, 1);
+    return ptr;
+}
+
+void free(void* ptr) CTEST_IMPL_MALLOC_THROW {
+    size_t size;
+    if (ptr && ctest_heap_tracked()) ctest_heap_untrack(ptr, &size);
+    __libc_free(ptr);
+}
 #endif
 
-    if (argc == 2) {
-        suite_name = argv[1];
-        filter = suite_filter;
+// tracks the blocks of the test, from its setup to its teardown
+static void ctest_heap_begin(void) {
+#ifdef CTEST_MALLOC
+    ctest_heap_lock();
+    if (ctest_heap_slots > CTEST_HEAP_SLOTS) {
+        __libc_free(ctest_heap_blocks);
+        ctest_heap_blocks = NULL;
+        ctest_heap_slots = 0;
     }
-#ifdef CTEST_NO_COLORS
-    color_output = 0;
+    if (ctest_heap_blocks) memset(ctest_heap_blocks, 0, ctest_heap_slots * sizeof(struct ctest_heap_block));
+    ctest_heap_live = 0;
+    ctest_heap_live_bytes = 0;
+    ctest_heap_unlock();
+    __atomic_store_n(&ctest_heap_tracking, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+// returns the number of blocks the test didn't free, and their size
+static uint64_t ctest_heap_end(uint64_t* bytes) {
+    uint64_t live = 0;
+    *bytes = 0;
+#ifdef CTEST_MALLOC
+    __atomic_store_n(&ctest_heap_tracking, 0, __ATOMIC_RELAXED);
+    ctest_heap_lock();
+    live = ctest_heap_live;
+    *bytes = ctest_heap_live_bytes;
+    ctest_heap_unlock();
+#endif
+    return live;
+}
+
+static void ctest_heap_snapshot(struct ctest_heap_stats* stats) {
+    stats->allocs = __atomic_load_n(&ctest_heap.allocs, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&ctest_heap.bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t ctest_alloc_count(void) {
+    return __atomic_load_n(&ctest_heap.allocs, __ATOMIC_RELAXED);
+}
+
+void assert_no_alloc(uint64_t allocs_before, const char* caller, int line) {
+    CTEST_IMPL_COUNT_ASSERT();
+    uint64_t allocs = ctest_alloc_count() - allocs_before;
+    if (allocs != 0) {
+        CTEST_ERR("%s:%d  %" PRIu64 " heap allocation(s) where none are allowed", caller, line, allocs);
+    }
+}
+
+
+// --filter/--exclude, matched against "suite:test"
+struct ctest_pattern {
+    char* glob;     // NULL for a regex
+    int exclude;
+#ifdef CTEST_IMPL_REGEX
+    regex_t re;
+#endif
+};
+
+static struct ctest_pattern* ctest_patterns;
+static int ctest_num_patterns;
+static int ctest_num_includes;
+
+// returns the pattern after the element matching c, NULL if it doesn't match
+static const char* ctest_glob_char(const char* pat, char c) {
+    if (*pat == 0) return NULL;
+    if (*pat == '?') return pat + 1;
+    if (*pat == '[') {
+        const char* p = pat + 1;
+        int negate = (*p == '!' || *p == '^');
+        int found = 0;
+        if (negate) p++;
+        if (*p == ']') {    // a ']' right after the '[' is part of the set
+            found = (c == ']');
+            p++;
+        }
+        while (*p && *p != ']') {
+            if (p[1] == '-' && p[2] && p[2] != ']') {
+                if (c >= p[0] && c <= p[2]) found = 1;
+                p += 3;
+            } else {
+                if (c == *p) found = 1;
+                p++;
+            }
+        }
+        if (*p == ']') return found != negate ? p + 1 : NULL;
+        // unterminated set, the '[' is a plain character
+    }
+    return *pat == c ? pat + 1 : NULL;
+}
+
+// '*', '?' and '[...]' over the whole string, backtracking only to the last '*'
+static int ctest_glob(const char* pat, const char* str) {
+    const char* star = NULL;
+    const char* retry = NULL;
+    while (*str) {
+        if (*pat == '*') {
+            star = ++pat;
+            retry = str;
+            continue;
+        }
+        const char* next = ctest_glob_char(pat, *str);
+        if (next) {
+            pat = next;
+            str++;
+        } else if (star) {
+            pat = star;
+            str = ++retry;
+        } else {
+            return 0;
+        }
+    }
+    while (*pat == '*') pat++;
+    return *pat == 0;
+}
+
+// patterns are 're:REGEX' or globs; a glob without a ':' only names suites
+static int ctest_compile_pattern(struct ctest_pattern* p, const char* text, int exclude, int prefix) {
+    memset(p, 0, sizeof(*p));
+    p->exclude = exclude;
+    if (strncmp(text, "re:", 3) == 0) {
+#ifdef CTEST_IMPL_REGEX
+        int err = regcomp(&p->re, text + 3, REG_EXTENDED | REG_NOSUB);
+        if (err != 0) {
+            char buf[256];
+            regerror(err, &p->re, buf, sizeof(buf));
+            fprintf(stderr, "invalid regex '%s': %s\n", text + 3, buf);
+            return -1;
+        }
 #else
-    color_output = isatty(1);
+        fprintf(stderr, "regex patterns are not supported on this platform\n");
+        return -1;
+#endif
+    } else {
+        size_t len = strlen(text);
+        p->glob = (char*) malloc(len + 4);
+        if (p->glob == NULL) return -1;
+        memcpy(p->glob, text, len + 1);
+        if (prefix) strcat(p->glob, "*");
+        if (strchr(text, ':') == NULL) strcat(p->glob, ":*");
+    }
+    return 0;
+}
+
+static void ctest_free_pattern(struct ctest_pattern* p) {
+    if (p->glob) free(p->glob);
+#ifdef CTEST_IMPL_REGEX
+    else regfree(&p->re);
+#endif
+}
+
+static int ctest_pattern_match(const struct ctest_pattern* p, const char* name) {
+#ifdef CTEST_IMPL_REGEX
+    if (p->glob == NULL) return regexec(&p->re, name, 0, NULL, 0) == 0;
 #endif
-    clock_t t1 = clock();
+    return ctest_glob(p->glob, name);
+}
+
+static int ctest_add_pattern(const char* text, int exclude, int prefix) {
+    if (ctest_compile_pattern(&ctest_patterns[ctest_num_patterns], text, exclude, prefix) != 0) return -1;
+    ctest_num_patterns++;
+    if (!exclude) ctest_num_includes++;
+    return 0;
+}
+
+// --changed: only run the tests defined in, or mapped to, the changed files
+struct ctest_map_rule {
+    char* source;   // glob for the changed files
+    struct ctest_pattern tests;
+    int active;     // a changed file matches
+};
+
+static int ctest_changed_mode;
+static char** ctest_changed_files;
+static size_t ctest_num_changed;
+static struct ctest_map_rule* ctest_map_rules;
+static size_t ctest_num_map_rules;
+
+static char* ctest_strdup(const char* s, size_t len) {
+    char* copy = (char*) malloc(len + 1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = 0;
+    return copy;
+}
+
+static int ctest_add_changed_file(const char* path, size_t len) {
+    static size_t capacity;
+    while (len > 0 && (*path == ' ' || *path == '\t')) { path++; len--; }
+    while (len > 0 && (path[len-1] == ' ' || path[len-1] == '\t' || path[len-1] == '\n' || path[len-1] == '\r')) len--;
+    if (len == 0) return 0;
+    if (ctest_num_changed == capacity) {
+        size_t n = capacity ? capacity * 2 : 16;
+        char** p = (char**) realloc(ctest_changed_files, n * sizeof(char*));
+        if (p == NULL) return -1;
+        ctest_changed_files = p;
+        capacity = n;
+    }
+    if ((ctest_changed_files[ctest_num_changed] = ctest_strdup(path, len)) == NULL) return -1;
+    ctest_num_changed++;
+    return 0;
+}
+
+// a comma separated list of files, or @FILE with one file per line
+static int ctest_parse_changed(const char* arg) {
+    ctest_changed_mode = 1;
+    if (arg[0] == '@') {
+        char line[4096];
+        FILE* f = fopen(arg + 1, "r");
+        if (f == NULL) {
+            perror(arg + 1);
+            return -1;
+        }
+        while (fgets(line, sizeof(line), f)) {
+            if (ctest_add_changed_file(line, strlen(line)) != 0) break;
+        }
+        fclose(f);
+        return 0;
+    }
+    while (*arg) {
+        const char* comma = strchr(arg, ',');
+        size_t len = comma ? (size_t) (comma - arg) : strlen(arg);
+        if (ctest_add_changed_file(arg, len) != 0) return -1;
+        arg += len + (comma != NULL);
+    }
+    return 0;
+}
+
+// lines of 'SOURCE_GLOB TEST_PATTERN', '#' starts a comment
+static int ctest_parse_changed_map(const char* filename) {
+    char line[4096];
+    int lineno = 0;
+    size_t capacity = 0;
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char source[2048];
+        char tests[2048];
+        lineno++;
+        char* hash = strchr(line, '#');
+        if (hash) *hash = 0;
+        int n = sscanf(line, "%2047s %2047s", source, tests);
+        if (n <= 0) continue;
+        if (n != 2) {
+            fprintf(stderr, "%s:%d: expected 'SOURCE_GLOB TEST_PATTERN'\n", filename, lineno);
+            fclose(f);
+            return -1;
+        }
+        if (ctest_num_map_rules == capacity) {
+            size_t c = capacity ? capacity * 2 : 16;
+            struct ctest_map_rule* p = (struct ctest_map_rule*) realloc(ctest_map_rules, c * sizeof(*p));
+            if (p == NULL) break;
+            ctest_map_rules = p;
+            capacity = c;
+        }
+        struct ctest_map_rule* rule = &ctest_map_rules[ctest_num_map_rules];
+        rule->active = 0;
+        rule->source = ctest_strdup(source, strlen(source));
+        if (rule->source == NULL || ctest_compile_pattern(&rule->tests, tests, 0, 0) != 0) {
+            free(rule->source);
+            fclose(f);
+            return -1;
+        }
+        ctest_num_map_rules++;
+    }
+    fclose(f);
+    return 0;
+}
+
+static const char* ctest_skip_dots(const char* path) {
+    while (1) {
+        if (strncmp(path, "./", 2) == 0) path += 2;
+        else if (strncmp(path, "../", 3) == 0) path += 3;
+        else return path;
+    }
+}
+
+// "/src/repo/tests/a.c", "../tests/a.c" and "tests/a.c" are the same file:
+// the shorter path has to be a suffix of the longer one, at a '/'
+static int ctest_same_file(const char* a, const char* b) {
+    a = ctest_skip_dots(a);
+    b = ctest_skip_dots(b);
+    size_t la = strlen(a);
+    size_t lb = strlen(b);
+    if (la > lb) {
+        const char* t = a; a = b; b = t;
+        size_t tl = la; la = lb; lb = tl;
+    }
+    return la > 0 && strcmp(b + lb - la, a) == 0 && (la == lb || b[lb - la - 1] == '/');
+}
+
+static void ctest_changed_prepare(void) {
+    size_t r;
+    size_t i;
+    for (r = 0; r < ctest_num_map_rules; r++) {
+        for (i = 0; i < ctest_num_changed && !ctest_map_rules[r].active; i++) {
+            ctest_map_rules[r].active = ctest_glob(ctest_map_rules[r].source, ctest_skip_dots(ctest_changed_files[i]));
+        }
+    }
+}
+
+static int ctest_changed(const struct ctest* t, const char* name) {
+    size_t i;
+    if (!ctest_changed_mode) return 1;
+    for (i = 0; i < ctest_num_changed; i++) {
+        if (ctest_same_file(t->file, ctest_changed_files[i])) return 1;
+    }
+    for (i = 0; i < ctest_num_map_rules; i++) {
+        if (ctest_map_rules[i].active && ctest_pattern_match(&ctest_map_rules[i].tests, name)) return 1;
+    }
+    return 0;
+}
+
+static void ctest_free_patterns(void) {
+    size_t i;
+    for (i = 0; i < (size_t) ctest_num_patterns; i++) ctest_free_pattern(&ctest_patterns[i]);
+    free(ctest_patterns);
+    ctest_patterns = NULL;
+    ctest_num_patterns = 0;
+    ctest_num_includes = 0;
+    for (i = 0; i < ctest_num_changed; i++) free(ctest_changed_files[i]);
+    free(ctest_changed_files);
+    ctest_changed_files = NULL;
+    ctest_num_changed = 0;
+    for (i = 0; i < ctest_num_map_rules; i++) {
+        free(ctest_map_rules[i].source);
+        ctest_free_pattern(&ctest_map_rules[i].tests);
+    }
+    free(ctest_map_rules);
+    ctest_map_rules = NULL;
+    ctest_num_map_rules = 0;
+}
+
+// selected if any include matches (or there are none) and no exclude does
+static int ctest_filter(const struct ctest* t) {
+    char name[512];
+    int included = (ctest_num_includes == 0);
+    int i;
+    if (ctest_num_patterns == 0 && !ctest_changed_mode) return 1;
+    snprintf(name, sizeof(name), "%s:%s", t->ssname, t->ttname);
+    // the rows (name/N) of a CTEST_PARAM test also match the name of the test
+    char* row = t->num_cases ? strrchr(name, '/') : NULL;
+    for (i = 0; i < ctest_num_patterns; i++) {
+        const struct ctest_pattern* p = &ctest_patterns[i];
+        if (included && !p->exclude) continue;
+        int match = ctest_pattern_match(p, name);
+        if (!match && row) {
+            *row = 0;
+            match = ctest_pattern_match(p, name);
+            *row = '/';
+        }
+        if (match && p->exclude) return 0;
+        if (match) included = 1;
+    }
+    return included && ctest_changed(t, name);
+}
+
+static int ctest_bench;     // run the benchmarks instead of the tests
+static int ctest_list;      // print the selected tests instead of running them
+
+// all registered tests, in registration (section) order
+static struct ctest** ctest_index;
+static size_t ctest_index_size;
 
+#ifdef CTEST_IMPL_SECTION_BOUNDS
+static void ctest_section_bounds(struct ctest** begin, struct ctest** end) {
+    *begin = &ctest_section_start;
+    *end = &ctest_section_stop;
+}
+#else
+// find begin and end of section by comparing magics
+__attribute__((no_sanitize_address)) static void ctest_section_bounds(struct ctest** begin, struct ctest** end) {
     struct ctest* ctest_begin = &CTEST_IMPL_TNAME(suite, test);
     struct ctest* ctest_end = &CTEST_IMPL_TNAME(suite, test);
-    // find begin and end of section by comparing magics
     while (1) {
         struct ctest* t = ctest_begin-1;
         if (t->magic != CTEST_IMPL_MAGIC) break;
@@ -551,58 +1934,2894 @@ __attribute__((no_sanitize_address)) int ctest_main(int argc, const char *argv[]
         if (t->magic != CTEST_IMPL_MAGIC) break;
         ctest_end++;
     }
-    ctest_end++;    // end after last one
-
-    static struct ctest* test;
-    for (test = ctest_begin; test != ctest_end; test++) {
-        if (test == &CTEST_IMPL_TNAME(suite, test)) continue;
-        if (filter(test)) total++;
-    }
-
-    for (test = ctest_begin; test != ctest_end; test++) {
-        if (test == &CTEST_IMPL_TNAME(suite, test)) continue;
-        if (filter(test)) {
-            ctest_errorbuffer[0] = 0;
-            ctest_errorsize = MSG_SIZE-1;
-            ctest_errormsg = ctest_errorbuffer;
-            printf("TEST %d/%d %s:%s ", idx, total, test->ssname, test->ttname);
-            fflush(stdout);
-            if (test->skip) {
-                color_print(ANSI_BYELLOW, "[SKIPPED]");
-                num_skip++;
-            } else {
-                int result = setjmp(ctest_err);
-                if (result == 0) {
-                    if (test->setup && *test->setup) (*test->setup)(test->data);
-                    if (test->data)
-                        test->run.unary(test->data);
-                    else
-                        test->run.nullary();
-                    if (test->teardown && *test->teardown) (*test->teardown)(test->data);
-                    // if we got here it's ok
-#ifdef CTEST_COLOR_OK
-                    color_print(ANSI_BGREEN, "[OK]");
+    *begin = ctest_begin;
+    *end = ctest_end + 1;   // end after last one
+}
+#endif
+
+static int ctest_build_index(void) {
+    struct ctest* begin;
+    struct ctest* end;
+    if (ctest_index) return 0;
+
+    ctest_section_bounds(&begin, &end);
+    const char* p = (const char*) begin;
+    size_t max = (size_t) ((const char*) end - p) / sizeof(struct ctest);
+    ctest_index = (struct ctest**) malloc((max + 1) * sizeof(struct ctest*));
+    if (ctest_index == NULL) return -1;
+    // the linker may leave (zeroed) padding between the entries, skip it
+    while (p + sizeof(struct ctest) <= (const char*) end) {
+        struct ctest* t = (struct ctest*) (uintptr_t) p;
+        if (t->magic != CTEST_IMPL_MAGIC) {
+            p += __alignof__(struct ctest);
+            continue;
+        }
+        if (t != &CTEST_IMPL_TNAME(suite, test)) ctest_index[ctest_index_size++] = t;
+        p += sizeof(struct ctest);
+    }
+    return 0;
+}
+
+// FNV-1a of "suite:test", stable across builds and machines
+static uint64_t ctest_hash_name(const struct ctest* t) {
+    uint64_t hash = 14695981039346656037u;
+    const char* p;
+    for (p = t->ssname; *p; p++) hash = (hash ^ (unsigned char) *p) * 1099511628211u;
+    hash = (hash ^ (unsigned char) ':') * 1099511628211u;
+    for (p = t->ttname; *p; p++) hash = (hash ^ (unsigned char) *p) * 1099511628211u;
+    return hash;
+}
+
+// benchmarks only run with --bench, and then only the benchmarks run
+static int ctest_select(const struct ctest* t) {
+    return (t->kind == CTEST_IMPL_KIND_BENCH) == (ctest_bench != 0) && ctest_filter(t);
+}
+
+static int ctest_shard_index;
+static int ctest_shard_count;   // 0 if not sharded
+static int ctest_shard_balance; // split by the history durations, after the selection
+
+static int ctest_in_shard(const struct ctest* t) {
+    return ctest_shard_count == 0 || ctest_shard_balance || ctest_hash_name(t) % (uint64_t) ctest_shard_count == (uint64_t) ctest_shard_index;
+}
+
+// the selected cases of a CTEST_PARAM test, only made when running it
+struct ctest_case_block {
+    struct ctest_case_block* next;
+    struct ctest* cases;
+    char* names;
+};
+
+static struct ctest_case_block* ctest_case_blocks;
+
+// selects the rows of a CTEST_PARAM test, each as a copy of it named tname/row
+static int ctest_select_cases(struct ctest* t, struct ctest** selected, size_t* total, size_t* num_filtered) {
+    size_t name_size = strlen(t->ttname) + 22;
+    size_t count = 0;
+    size_t row;
+    struct ctest_case_block* block = (struct ctest_case_block*) malloc(sizeof(struct ctest_case_block));
+    if (block == NULL) return -1;
+    block->cases = (struct ctest*) malloc(t->num_cases * sizeof(struct ctest));
+    block->names = (char*) malloc(t->num_cases * name_size);
+    block->next = ctest_case_blocks;
+    ctest_case_blocks = block;
+    if (block->cases == NULL || block->names == NULL) return -1;
+
+    char* name = block->names;
+    for (row = 0; row < t->num_cases; row++) {
+        struct ctest* c = &block->cases[count];
+        *c = *t;
+        c->case_index = row;
+        c->ttname = name;
+        snprintf(name, name_size, "%s/%" PRIu64, t->ttname, (uint64_t) row);
+        if (!ctest_select(c)) continue;
+        (*num_filtered)++;
+        if (!ctest_in_shard(c)) continue;
+        name += strlen(name) + 1;
+        selected[(*total)++] = c;
+        count++;
+    }
+    return 0;
+}
+
+static void ctest_free_cases(void) {
+    while (ctest_case_blocks) {
+        struct ctest_case_block* next = ctest_case_blocks->next;
+        free(ctest_case_blocks->cases);
+        free(ctest_case_blocks->names);
+        free(ctest_case_blocks);
+        ctest_case_blocks = next;
+    }
+}
+
+static void color_print(const char* color, const char* text) {
+    if (color_output)
+        printf("%s%s" ANSI_NORMAL "\n", color, text);
+    else
+        printf("%s\n", text);
+}
+
+#ifdef CTEST_SEGFAULT
+#include <signal.h>
+static void sighandler(int signum)
+{
+    const char msg_color[] = ANSI_BRED "[SIGSEGV: Segmentation fault]" ANSI_NORMAL "\n";
+    const char msg_nocolor[] = "[SIGSEGV: Segmentation fault]\n";
+
+    const char* msg = color_output ? msg_color : msg_nocolor;
+    write(STDOUT_FILENO, msg, (unsigned int)strlen(msg));
+
+    /* "Unregister" the signal handler and send the signal back to the process
+     * so it can terminate as expected */
+    signal(signum, SIG_DFL);
+#ifdef CTEST_IMPL_POSIX
+    kill(getpid(), signum);
+#endif
+}
+#endif
+
+enum {
+    CTEST_PENDING,
+    CTEST_OK,
+    CTEST_FAIL,
+    CTEST_SKIP,
+    CTEST_TIMEOUT   // a failure, stopped by the watchdog
+};
+
+// all times in ns per operation
+struct ctest_bench_stats {
+    uint64_t iterations;    // per sample
+    int samples;
+    double mean;
+    double min;
+    double median;
+    double p99;
+    double stddev;
+};
+
+// a suite with CTEST_SUITE_SETUP/TEARDOWN, set up before the first selected
+// test that needs it and torn down after the last one
+struct ctest_suite {
+    ctest_setup_func setup;
+    ctest_teardown_func teardown;
+    const char* name;
+    void* data;         // copied into the data of each test before its setup
+    size_t datasize;
+    size_t remaining;   // selected tests that haven't run yet
+    int state;
+};
+
+enum {
+    CTEST_SUITE_IDLE,
+    CTEST_SUITE_READY,
+    CTEST_SUITE_FAILED,
+    CTEST_SUITE_DONE
+};
+
+enum {
+    CTEST_PERF_CYCLES,
+    CTEST_PERF_INSTRUCTIONS,
+    CTEST_PERF_CACHE_MISSES,
+    CTEST_PERF_BRANCH_MISSES,
+    CTEST_PERF_PAGE_FAULTS,
+    CTEST_PERF_NUM
+};
+
+// hardware counters over the test body (--perf)
+struct ctest_perf_counts {
+    uint64_t values[CTEST_PERF_NUM];
+    uint64_t ops;           // iterations of a benchmark, 1 for tests
+    unsigned int valid;     // bit per counter that was measured
+};
+
+struct ctest_result {
+    struct ctest* test;
+    size_t id;                  // position in the selection, the same in every round
+    struct ctest_suite* suite;  // NULL without suite fixtures
+    int status;
+    uint64_t setup_ns;
+    uint64_t run_ns;
+    uint64_t teardown_ns;
+    struct ctest_bench_stats bench;
+    struct ctest_perf_counts perf;
+    uint64_t prop_runs;     // property tests: runs, and their time
+    uint64_t prop_ns;
+    uint64_t asserts;
+    uint64_t allocs;        // heap use over setup, run and teardown (CTEST_MALLOC)
+    uint64_t alloc_bytes;
+    size_t msg_offset;  // error/log output of parallel runs, in ctest_pool.msgs
+    size_t msg_len;
+    int msg_spilled;    // msg_offset is in ctest_pool.spill_fd instead
+};
+
+#ifdef CTEST_IMPL_FORK
+struct ctest_worker {
+    pid_t pid;
+    size_t current;     // index of the test being run, SIZE_MAX if idle
+    uint64_t started_ns;    // when it started the current test
+    char log[MSG_SIZE]; // output of the current test, survives a crash
+};
+#endif
+
+// with -j the pool and everything it points to is shared with the workers
+struct ctest_pool {
+    size_t next;        // first test not yet claimed by a worker
+    size_t count;
+    size_t msg_used;
+    size_t msg_size;
+    char* msgs;
+    size_t spill_used;  // logs larger than MSG_SIZE, written to spill_fd
+    int spill_fd;
+    struct ctest_result* results;
+#ifdef CTEST_IMPL_FORK
+    struct ctest_worker* workers;
+#endif
+    size_t alloc_size;
+    int shared;
+};
+
+// results of all rounds (--repeat/--until-fail), indexed by ctest_result.id
+struct ctest_test_stats {
+    struct ctest* test;
+    uint32_t passes;
+    uint32_t fails;
+    double mean_ns;     // running mean and sum of squared differences (Welford)
+    double m2;
+};
+
+static struct ctest_pool* ctest_pool;
+#ifdef CTEST_IMPL_FORK
+static FILE* ctest_pool_spill;
+#endif
+static struct ctest_test_stats* ctest_stats;
+static int ctest_repeat;        // rounds, 0 if not given
+static int ctest_until_fail;
+static int ctest_max_rounds;    // 0 = until a test fails
+static int ctest_round;
+static int ctest_shuffle;
+static uint64_t ctest_seed;
+static struct ctest_suite* ctest_suites;
+static size_t ctest_num_suites;
+static int ctest_jobs = 1;
+#ifdef CTEST_ISOLATE
+#ifndef CTEST_ISOLATE_BATCH
+#define CTEST_ISOLATE_BATCH 16
+#endif
+static int ctest_isolate = CTEST_ISOLATE_BATCH;
 #else
-                    printf("[OK]\n");
+static int ctest_isolate;   // tests per worker process, 0 = unlimited
 #endif
-                    num_ok++;
-                } else {
-                    color_print(ANSI_BRED, "[FAIL]");
-                    num_fail++;
-                }
-                if (ctest_errorsize != MSG_SIZE-1) printf("%s", ctest_errorbuffer);
-            }
-            idx++;
+static int ctest_show_time;
+static unsigned int ctest_timeout_ms;   // --timeout, for tests without their own
+static int ctest_tolerance = 20;    // percent slower than the baseline that still passes
+#define CTEST_BASELINE_MIN_NS 1000000   // differences below 1 ms are noise
+static int ctest_show_allocs;
+static int ctest_show_asserts;
+static uint64_t ctest_num_asserts;
+static int ctest_num_slowest;
+static uint64_t ctest_bench_time_ns = 1000000000u;
+static int ctest_bench_samples = 20;
+#define CTEST_BENCH_MAX_SAMPLES 1000
+static const char* ctest_bench_save_file;       // --bench-save
+static const char* ctest_bench_compare_file;    // --bench-compare
+static double* ctest_bench_store;   // sorted samples of every benchmark, by result id
+static uint64_t ctest_prop_runs;        // --prop-runs, 0 if not given
+static uint64_t ctest_prop_time_ns;     // --prop-time, 0 = no limit
+static uint64_t ctest_prop_seed;        // --seed
+static int ctest_prop_seeded;
+#define CTEST_PROP_DEFAULT_RUNS 1000
+static int ctest_num_ok;
+static int ctest_num_fail;
+static int ctest_num_skip;
+
+static struct ctest_pool* ctest_pool_create(size_t count, int shared) {
+    size_t msg_size = shared ? count * MSG_SIZE : 0;
+    size_t size = sizeof(struct ctest_pool) + count * sizeof(struct ctest_result) + msg_size;
+    struct ctest_pool* pool;
+#ifdef CTEST_IMPL_FORK
+    size_t workers_size = (size_t) ctest_jobs * sizeof(struct ctest_worker);
+    size += workers_size;
+    if (shared) {
+        void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+        if (p == MAP_FAILED) return NULL;
+        pool = (struct ctest_pool*) p;
+    } else
+#endif
+    {
+        pool = (struct ctest_pool*) calloc(1, size);
+        if (pool == NULL) return NULL;
+    }
+    pool->count = count;
+    pool->msg_size = msg_size;
+    pool->results = (struct ctest_result*) (pool + 1);
+#ifdef CTEST_IMPL_FORK
+    pool->workers = (struct ctest_worker*) (pool->results + count);
+    pool->msgs = (char*) pool->workers + workers_size;
+#else
+    pool->msgs = (char*) (pool->results + count);
+#endif
+    pool->alloc_size = size;
+    pool->shared = shared;
+    pool->spill_fd = -1;
+#ifdef CTEST_IMPL_FORK
+    // created before the workers, so they all share it
+    if (shared) ctest_pool_spill = tmpfile();
+    if (ctest_pool_spill) pool->spill_fd = fileno(ctest_pool_spill);
+#endif
+    return pool;
+}
+
+// prepares the pool for another round, running the tests in the given order
+static void ctest_pool_reset(struct ctest_pool* pool, const size_t* order) {
+    size_t i;
+    pool->next = 0;
+    pool->msg_used = 0;
+    pool->spill_used = 0;
+    memset(pool->results, 0, pool->count * sizeof(struct ctest_result));
+    for (i = 0; i < pool->count; i++) {
+        pool->results[i].id = order[i];
+        pool->results[i].test = ctest_stats[order[i]].test;
+    }
+}
+
+static void ctest_pool_destroy(struct ctest_pool* pool) {
+#ifdef CTEST_IMPL_FORK
+    if (ctest_pool_spill) fclose(ctest_pool_spill);
+    ctest_pool_spill = NULL;
+    if (pool->shared) {
+        munmap(pool, pool->alloc_size);
+        return;
+    }
+#endif
+    free(pool);
+}
+
+#ifdef CTEST_IMPL_FORK
+// copy the output of a test into the shared message area
+static void ctest_save_msg(struct ctest_result* res, const char* msg, size_t len) {
+    // there is room for MSG_SIZE per test, larger logs go to the spill file
+    if (len > MSG_SIZE && ctest_pool->spill_fd >= 0) {
+        size_t offset = __atomic_fetch_add(&ctest_pool->spill_used, len, __ATOMIC_RELAXED);
+        if (pwrite(ctest_pool->spill_fd, msg, len, (off_t) offset) == (ssize_t) len) {
+            res->msg_offset = offset;
+            res->msg_len = len;
+            res->msg_spilled = 1;
+            return;
         }
     }
-    clock_t t2 = clock();
+    size_t offset = __atomic_fetch_add(&ctest_pool->msg_used, len, __ATOMIC_RELAXED);
+    if (offset >= ctest_pool->msg_size) len = 0;
+    else if (len > ctest_pool->msg_size - offset) len = ctest_pool->msg_size - offset;
+    memcpy(ctest_pool->msgs + offset, msg, len);
+    res->msg_offset = offset;
+    res->msg_len = len;
+}
+
+// reads back a log that ctest_save_msg() wrote to the spill file
+static char* ctest_load_msg(const struct ctest_result* res) {
+    char* msg = (char*) malloc(res->msg_len);
+    if (msg && pread(ctest_pool->spill_fd, msg, res->msg_len, (off_t) res->msg_offset) != (ssize_t) res->msg_len) {
+        free(msg);
+        msg = NULL;
+    }
+    return msg;
+}
+#endif
+
+static uint64_t ctest_now_ns(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+#else
+    return (uint64_t) clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+// formats a duration with a unit that keeps 3 significant digits
+static const char* ctest_format_ns(char* buf, size_t size, double ns) {
+    if (ns < 1e3) snprintf(buf, size, "%.3g ns", ns);
+    else if (ns < 1e6) snprintf(buf, size, "%.1f us", ns / 1e3);
+    else if (ns < 1e9) snprintf(buf, size, "%.1f ms", ns / 1e6);
+    else snprintf(buf, size, "%.2f s", ns / 1e9);
+    return buf;
+}
+
+static const char* ctest_format_count(char* buf, size_t size, double n) {
+    if (n < 1e3) snprintf(buf, size, "%.3g", n);
+    else if (n < 1e6) snprintf(buf, size, "%.3gk", n / 1e3);
+    else if (n < 1e9) snprintf(buf, size, "%.3gM", n / 1e6);
+    else snprintf(buf, size, "%.3gG", n / 1e9);
+    return buf;
+}
+
+static int ctest_perf;      // --perf
+#ifdef CTEST_IMPL_PERF
+static int ctest_perf_state;    // 0 = not opened yet, 1 = open, -1 = unavailable
+static int ctest_perf_leader = -1;
+static int ctest_perf_members[CTEST_PERF_NUM];  // counter of each value in a group read
+static int ctest_perf_num_members;
+
+static int ctest_perf_open_counter(uint32_t type, uint64_t config, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = (group < 0);    // members follow the leader
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// opens the counters as one group, leaving out the ones the cpu, VM or
+// perf_event_paranoid setting doesn't allow
+static int ctest_perf_open(void) {
+    static const uint32_t types[CTEST_PERF_NUM] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE
+    };
+    static const uint64_t configs[CTEST_PERF_NUM] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_SW_PAGE_FAULTS
+    };
+    int i;
+    for (i = 0; i < CTEST_PERF_NUM; i++) {
+        int fd = ctest_perf_open_counter(types[i], configs[i], ctest_perf_leader);
+        if (fd < 0) continue;
+        if (ctest_perf_leader < 0) ctest_perf_leader = fd;
+        ctest_perf_members[ctest_perf_num_members++] = i;
+    }
+    if (ctest_perf_leader < 0) {
+        fprintf(stderr, "ctest: --perf: no performance counters available (%s)\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+static void ctest_perf_start(void) {
+#ifdef CTEST_IMPL_PERF
+    if (!ctest_perf || ctest_perf_state < 0) return;
+    if (ctest_perf_state == 0) {
+        ctest_perf_state = ctest_perf_open() == 0 ? 1 : -1;
+        if (ctest_perf_state < 0) return;
+    }
+    ioctl(ctest_perf_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(ctest_perf_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+static void ctest_perf_stop(struct ctest_perf_counts* counts, uint64_t ops) {
+#ifdef CTEST_IMPL_PERF
+    uint64_t buf[3 + CTEST_PERF_NUM];   // nr, time enabled, time running, values
+    int i;
+    if (ctest_perf_state <= 0) return;
+    ioctl(ctest_perf_leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    ssize_t n = read(ctest_perf_leader, buf, sizeof(buf));
+    if (n < (ssize_t) (3 * sizeof(uint64_t)) || buf[2] == 0) return;
+    for (i = 0; i < (int) buf[0] && i < ctest_perf_num_members; i++) {
+        // scale up if the counters had to share the pmu with others
+        double value = (double) buf[3 + i] * ((double) buf[1] / (double) buf[2]);
+        counts->values[ctest_perf_members[i]] = (uint64_t) value;
+        counts->valid |= 1u << ctest_perf_members[i];
+    }
+    counts->ops = ops;
+#else
+    (void) counts;
+    (void) ops;
+#endif
+}
 
-    const char* color = (num_fail) ? ANSI_BRED : ANSI_GREEN;
-    char results[80];
-    snprintf(results, sizeof(results), "RESULTS: %d tests (%d ok, %d failed, %d skipped) ran in %.1f ms",
-             total, num_ok, num_fail, num_skip, (double)(t2 - t1)*1000.0/CLOCKS_PER_SEC);
-    color_print(color, results);
-    return num_fail;
+// no need to link libm for this
+static double ctest_sqrt(double x) {
+    double r = x;
+    int i;
+    if (x <= 0) return 0;
+    for (i = 0; i < 64; i++) {
+        double next = 0.5 * (r + x / r);
+        if (next == r) break;
+        r = next;
+    }
+    return r;
+}
+
+static int ctest_cmp_double(const void* a, const void* b) {
+    double da = *(const double*) a;
+    double db = *(const double*) b;
+    return (da > db) - (da < db);
+}
+
+static uint64_t ctest_bench_loop(struct ctest* test, uint64_t iterations) {
+    uint64_t i;
+    uint64_t start = ctest_now_ns();
+    if (test->data) {
+        for (i = 0; i < iterations; i++) test->run.unary(test->data);
+    } else {
+        for (i = 0; i < iterations; i++) test->run.nullary();
+    }
+    return ctest_now_ns() - start;
+}
+
+// Grows the iteration count until a sample takes its share of the time
+// budget, then takes the samples.
+static void ctest_run_bench(struct ctest_result* res) {
+    struct ctest_bench_stats* stats = &res->bench;
+    double samples[CTEST_BENCH_MAX_SAMPLES];
+    int num = ctest_bench_samples;
+    uint64_t target = ctest_bench_time_ns / (uint64_t) num;
+    uint64_t iterations = 1;
+    double sum = 0;
+    double var = 0;
+    int i;
+
+    while (1) {
+        uint64_t ns = ctest_bench_loop(res->test, iterations);
+        if (ns >= target || iterations >= UINT64_MAX / 100) break;
+        uint64_t grow = ns ? target / ns + 1 : 100;
+        if (grow < 2) grow = 2;
+        if (grow > 100) grow = 100;
+        iterations *= grow;
+    }
+
+    ctest_perf_start();
+    for (i = 0; i < num; i++) {
+        samples[i] = (double) ctest_bench_loop(res->test, iterations) / (double) iterations;
+        sum += samples[i];
+    }
+    ctest_perf_stop(&res->perf, iterations * (uint64_t) num);
+    qsort(samples, (size_t) num, sizeof(samples[0]), ctest_cmp_double);
+    if (ctest_bench_store) memcpy(ctest_bench_store + res->id * (size_t) num, samples, (size_t) num * sizeof(double));
+    stats->iterations = iterations;
+    stats->samples = num;
+    stats->mean = sum / num;
+    stats->min = samples[0];
+    stats->median = (num % 2) ? samples[num/2] : (samples[num/2 - 1] + samples[num/2]) / 2;
+    stats->p99 = samples[(num * 99 + 99) / 100 - 1];
+    for (i = 0; i < num; i++) var += (samples[i] - stats->mean) * (samples[i] - stats->mean);
+    stats->stddev = num > 1 ? ctest_sqrt(var / (num - 1)) : 0;
+}
+
+// splitmix64, good enough to shuffle and generate and reproducible from the seed
+static uint64_t ctest_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15u);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+    return z ^ (z >> 31);
+}
+
+#ifndef CTEST_PROP_MAX_CHOICES
+#define CTEST_PROP_MAX_CHOICES 8192     // random choices a property can draw per run
+#endif
+#ifndef CTEST_PROP_ARENA_SIZE
+#define CTEST_PROP_ARENA_SIZE (64 * 1024)   // generated buffers and strings per run
+#endif
+#define CTEST_PROP_MAX_SHRINKS 10000    // runs spent shrinking a failing input
+#define CTEST_PROP_OVERRUN 2    // a run that drew past the limits, it's discarded
+
+// A property draws its inputs from a sequence of random choices, smaller
+// choices make simpler values. A failing input is shrunk by running the
+// property on shorter and smaller sequences; choices drawn past the end of
+// those are 0. Runs don't allocate: the choices and the generated data live
+// in static buffers that are reused by every run.
+static uint64_t ctest_prop_choices[CTEST_PROP_MAX_CHOICES];
+static uint64_t ctest_prop_best[CTEST_PROP_MAX_CHOICES];    // the smallest failing sequence
+static unsigned char ctest_prop_lengths[CTEST_PROP_MAX_CHOICES];    // which choices are lengths
+static unsigned char ctest_prop_best_lengths[CTEST_PROP_MAX_CHOICES];
+static size_t ctest_prop_used;      // choices drawn by this run
+static size_t ctest_prop_replay;    // choices replayed from ctest_prop_choices
+static int ctest_prop_shrinking;
+static int ctest_prop_active;
+static int ctest_prop_show;         // log the generated values
+static int ctest_prop_num_inputs;
+static uint64_t ctest_prop_state;
+static unsigned char ctest_prop_arena[CTEST_PROP_ARENA_SIZE];
+static size_t ctest_prop_arena_used;
+
+static void ctest_prop_overrun(const char* what) {
+    if (ctest_prop_active && ctest_is_runner) longjmp(ctest_err, CTEST_PROP_OVERRUN);
+    CTEST_ERR("%s", what);
+}
+
+static uint64_t ctest_prop_draw(void) {
+    uint64_t v;
+    if (ctest_prop_used == CTEST_PROP_MAX_CHOICES) ctest_prop_overrun("too many generated values (CTEST_PROP_MAX_CHOICES)");
+    ctest_prop_lengths[ctest_prop_used] = 0;
+    if (ctest_prop_used < ctest_prop_replay) return ctest_prop_choices[ctest_prop_used++];
+    if (ctest_prop_shrinking) {
+        v = 0;
+    } else {
+        v = ctest_random(&ctest_prop_state);
+        // one in 8 is small, the edge cases are there
+        if ((v & 7) == 0) v >>= 58;
+    }
+    ctest_prop_choices[ctest_prop_used++] = v;
+    return v;
+}
+
+// a choice in 0..max. It's recorded as drawn, so shrinking it by n shrinks
+// the value by n
+static uint64_t ctest_prop_below(uint64_t max) {
+    uint64_t v = ctest_prop_draw();
+    if (max != UINT64_MAX) v %= max + 1;
+    ctest_prop_choices[ctest_prop_used - 1] = v;
+    return v;
+}
+
+// the length of a buffer or string: removing elements shrinks it too
+static size_t ctest_prop_length(size_t min_len, size_t max_len) {
+    size_t n = min_len + (size_t) ctest_prop_below(max_len - min_len);
+    ctest_prop_lengths[ctest_prop_used - 1] = 1;
+    return n;
+}
+
+// n + 1 bytes, so strings have room for their terminator
+static unsigned char* ctest_prop_alloc(size_t n) {
+    if (n >= CTEST_PROP_ARENA_SIZE - ctest_prop_arena_used) ctest_prop_overrun("generated data too large (CTEST_PROP_ARENA_SIZE)");
+    unsigned char* p = ctest_prop_arena + ctest_prop_arena_used;
+    ctest_prop_arena_used += n + 1;
+    return p;
+}
+
+int64_t ctest_gen_int(int64_t min, int64_t max) {
+    if (min > max) CTEST_ERR("ctest_gen_int: min %" PRId64 " > max %" PRId64, min, max);
+    uint64_t r = ctest_prop_below((uint64_t) max - (uint64_t) min);
+    // zigzag (0, -1, 1, -2...) when 0 is in the range, so values shrink towards 0
+    int64_t v = (int64_t) (r >> 1) ^ -(int64_t) (r & 1);
+    if (v < min || v > max) v = (int64_t) ((uint64_t) min + r);
+    if (ctest_prop_show) ctest_log(CTEST_LOG_INFO, "input %d: %" PRId64, ++ctest_prop_num_inputs, v);
+    return v;
+}
+
+const unsigned char* ctest_gen_bytes(size_t min_len, size_t max_len, size_t* len) {
+    size_t i;
+    if (min_len > max_len) CTEST_ERR("ctest_gen_bytes: min_len %" PRIuMAX " > max_len %" PRIuMAX, (uintmax_t) min_len, (uintmax_t) max_len);
+    size_t n = ctest_prop_length(min_len, max_len);
+    unsigned char* p = ctest_prop_alloc(n);
+    for (i = 0; i < n; i++) p[i] = (unsigned char) ctest_prop_below(255);
+    *len = n;
+    if (ctest_prop_show) {
+        static const char digits[] = "0123456789abcdef";
+        char hex[3 * 256 + 1];
+        size_t shown = n < 256 ? n : 256;
+        for (i = 0; i < shown; i++) {
+            hex[3*i] = ' ';
+            hex[3*i + 1] = digits[p[i] >> 4];
+            hex[3*i + 2] = digits[p[i] & 15];
+        }
+        hex[3 * shown] = 0;
+        ctest_log(CTEST_LOG_INFO, "input %d: %" PRIuMAX " bytes%s%s", ++ctest_prop_num_inputs, (uintmax_t) n, hex, shown < n ? " ..." : "");
+    }
+    return p;
+}
+
+// printable ASCII
+const char* ctest_gen_str(size_t min_len, size_t max_len) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+                                   " !\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~";
+    size_t i;
+    if (min_len > max_len) CTEST_ERR("ctest_gen_str: min_len %" PRIuMAX " > max_len %" PRIuMAX, (uintmax_t) min_len, (uintmax_t) max_len);
+    size_t n = ctest_prop_length(min_len, max_len);
+    char* p = (char*) ctest_prop_alloc(n);
+    for (i = 0; i < n; i++) p[i] = alphabet[ctest_prop_below(sizeof(alphabet) - 2)];
+    p[n] = 0;
+    if (ctest_prop_show) {
+        int shown = n < 1024 ? (int) n : 1024;
+        ctest_log(CTEST_LOG_INFO, "input %d: \"%.*s\"%s", ++ctest_prop_num_inputs, shown, p, (size_t) shown < n ? " ..." : "");
+    }
+    return p;
+}
+
+// one run of the property: 0 if it held, 1 if it failed, or CTEST_PROP_OVERRUN
+static int ctest_prop_call(struct ctest* test) {
+    int r = setjmp(ctest_err);
+    if (r != 0) return r;
+    ctest_prop_used = 0;
+    ctest_prop_arena_used = 0;
+    ctest_prop_num_inputs = 0;
+    if (test->data)
+        test->run.unary(test->data);
+    else
+        test->run.nullary();
+    return 0;
+}
+
+// shortlex order: shorter sequences first
+static int ctest_prop_smaller(const uint64_t* a, size_t alen, const uint64_t* b, size_t blen) {
+    size_t i;
+    if (alen != blen) return alen < blen;
+    for (i = 0; i < alen; i++) {
+        if (a[i] != b[i]) return a[i] < b[i];
+    }
+    return 0;
+}
+
+// runs the property on the first n choices, they become the best if it
+// still fails and they're smaller
+static int ctest_prop_try(struct ctest* test, size_t n, size_t* best_len, size_t mark) {
+    ctest_prop_replay = n;
+    int r = ctest_prop_call(test);
+    ctest_log_truncate(mark);
+    if (r != 1 || !ctest_prop_smaller(ctest_prop_choices, ctest_prop_used, ctest_prop_best, *best_len)) return 0;
+    memcpy(ctest_prop_best, ctest_prop_choices, ctest_prop_used * sizeof(uint64_t));
+    memcpy(ctest_prop_best_lengths, ctest_prop_lengths, ctest_prop_used);
+    *best_len = ctest_prop_used;
+    return 1;
+}
+
+// Removes chunks of choices (with the length they're counted in), zeroes
+// them and lowers single choices, until none of that fails anymore. Returns
+// the number of smaller failures found
+static int ctest_prop_shrink(struct ctest* test, size_t* len, size_t mark) {
+    const size_t word = sizeof(uint64_t);
+    int tries = 0;
+    int found = 0;
+    int progress = 1;
+    ctest_prop_shrinking = 1;
+    while (progress && tries < CTEST_PROP_MAX_SHRINKS) {
+        size_t k, i, j;
+        progress = 0;
+        for (k = 8; k >= 1; k /= 2) {
+            for (i = 0; i + k <= *len && tries < CTEST_PROP_MAX_SHRINKS; ) {
+                memcpy(ctest_prop_choices, ctest_prop_best, i * word);
+                memcpy(ctest_prop_choices + i, ctest_prop_best + i + k, (*len - i - k) * word);
+                tries++;
+                if (ctest_prop_try(test, *len - k, len, mark)) {
+                    found++;
+                    progress = 1;
+                    continue;
+                }
+                for (j = i; j > 0 && !ctest_prop_best_lengths[j-1]; j--) continue;
+                if (j > 0 && ctest_prop_best[j-1] >= k) {
+                    ctest_prop_choices[j-1] -= k;
+                    tries++;
+                    if (ctest_prop_try(test, *len - k, len, mark)) {
+                        found++;
+                        progress = 1;
+                        continue;
+                    }
+                }
+                for (j = i; j < i + k && ctest_prop_best[j] == 0; j++) continue;
+                if (j < i + k) {
+                    memcpy(ctest_prop_choices, ctest_prop_best, *len * word);
+                    memset(ctest_prop_choices + i, 0, k * word);
+                    tries++;
+                    if (ctest_prop_try(test, *len, len, mark)) {
+                        found++;
+                        progress = 1;
+                    }
+                }
+                i++;
+            }
+        }
+        // binary search for the smallest value of each choice that still fails
+        for (i = 0; i < *len && tries < CTEST_PROP_MAX_SHRINKS; i++) {
+            uint64_t lo = 0;
+            while (i < *len && lo < ctest_prop_best[i] && tries < CTEST_PROP_MAX_SHRINKS) {
+                memcpy(ctest_prop_choices, ctest_prop_best, *len * word);
+                ctest_prop_choices[i] = lo + (ctest_prop_best[i] - lo) / 2;
+                tries++;
+                if (ctest_prop_try(test, *len, len, mark)) {
+                    found++;
+                    progress = 1;
+                } else {
+                    lo = ctest_prop_choices[i] + 1;
+                }
+            }
+        }
+    }
+    return found;
+}
+
+// Runs the property until it fails or the runs or time are used up. The
+// runs that passed leave nothing in the log, a failure logs the shrunk input
+// and its failure.
+static void ctest_run_property(struct ctest_result* res) {
+    struct ctest* test = res->test;
+    uint64_t max_runs = ctest_prop_runs ? ctest_prop_runs : (ctest_prop_time_ns ? UINT64_MAX : CTEST_PROP_DEFAULT_RUNS);
+    uint64_t start = ctest_now_ns();
+    uint64_t runs = 0;
+    uint64_t discarded = 0;
+    size_t mark = ctest_errorused;
+    int failed = 0;
+    int shrinks = 0;
+    jmp_buf saved;
+
+    memcpy(saved, ctest_err, sizeof(jmp_buf));
+    ctest_prop_active = 1;
+    ctest_prop_state = ctest_prop_seed ^ ctest_hash_name(test);
+    while (runs < max_runs) {
+        int r = ctest_prop_call(test);
+        runs++;
+        ctest_log_truncate(mark);
+        if (r == 1) {
+            failed = 1;
+            break;
+        }
+        if (r == CTEST_PROP_OVERRUN) discarded++;
+        if (ctest_prop_time_ns && ctest_now_ns() - start >= ctest_prop_time_ns) break;
+    }
+    res->prop_runs = runs;
+    res->prop_ns = ctest_now_ns() - start;
+    if (failed) {
+        size_t len = ctest_prop_used;
+        memcpy(ctest_prop_best, ctest_prop_choices, len * sizeof(uint64_t));
+        memcpy(ctest_prop_best_lengths, ctest_prop_lengths, len);
+        shrinks = ctest_prop_shrink(test, &len, mark);
+        // once more with the smallest input, logging it
+        memcpy(ctest_prop_choices, ctest_prop_best, len * sizeof(uint64_t));
+        ctest_prop_replay = len;
+        ctest_prop_show = 1;
+        ctest_prop_call(test);
+        ctest_prop_show = 0;
+    }
+    ctest_prop_active = 0;
+    ctest_prop_shrinking = 0;
+    ctest_prop_replay = 0;
+    memcpy(ctest_err, saved, sizeof(jmp_buf));
+    if (failed) {
+        CTEST_ERR("property failed on run %" PRIu64 ", shrunk %d times. Replay with --seed=%" PRIu64 " %s:%s",
+                  runs, shrinks, ctest_prop_seed, test->ssname, test->ttname);
+    }
+    if (discarded == runs) CTEST_ERR("every run generated more than the limits (CTEST_PROP_MAX_CHOICES, CTEST_PROP_ARENA_SIZE)");
+}
+
+// the phase (setup/run/teardown) of the running test that is being timed
+static uint64_t* ctest_timer;
+static uint64_t ctest_timer_start;
+
+static void ctest_timer_begin(uint64_t* phase) {
+    ctest_timer = phase;
+    ctest_timer_start = ctest_now_ns();
+}
+
+static void ctest_timer_end(void) {
+    if (ctest_timer) *ctest_timer += ctest_now_ns() - ctest_timer_start;
+    ctest_timer = NULL;
+}
+
+// fails a test that didn't free all the memory it allocated (CTEST_MALLOC)
+static int ctest_heap_check(struct ctest_result* res, const struct ctest_heap_stats* before) {
+    struct ctest_heap_stats after;
+    ctest_heap_snapshot(&after);
+    res->allocs = after.allocs - before->allocs;
+    res->alloc_bytes = after.bytes - before->bytes;
+    uint64_t bytes;
+    uint64_t leaked = ctest_heap_end(&bytes);
+    if (leaked == 0) return CTEST_OK;
+    msg_start("ERR");
+    print_errormsg("leaked %" PRIu64 " block(s), %" PRIu64 " bytes", leaked, bytes);
+    msg_end();
+    return CTEST_FAIL;
+}
+
+// groups the selected tests by their suite fixtures
+static int ctest_suites_create(void) {
+    size_t i;
+    free(ctest_suites);
+    ctest_num_suites = 0;
+    ctest_suites = (struct ctest_suite*) calloc(ctest_pool->count + 1, sizeof(struct ctest_suite));
+    if (ctest_suites == NULL) return -1;
+    for (i = 0; i < ctest_pool->count; i++) {
+        struct ctest_result* res = &ctest_pool->results[i];
+        struct ctest* test = res->test;
+        ctest_setup_func setup = test->suite_setup ? *test->suite_setup : NULL;
+        ctest_teardown_func teardown = test->suite_teardown ? *test->suite_teardown : NULL;
+        if (test->skip || (setup == NULL && teardown == NULL)) continue;
+
+        // the tests of a suite are mostly adjacent, look at the last one first
+        size_t s = ctest_num_suites;
+        while (s > 0 && (ctest_suites[s-1].setup != setup || ctest_suites[s-1].teardown != teardown)) s--;
+        struct ctest_suite* suite = &ctest_suites[s > 0 ? s-1 : ctest_num_suites];
+        if (s == 0) {
+            suite->setup = setup;
+            suite->teardown = teardown;
+            suite->name = test->ssname;
+            suite->datasize = test->datasize;
+            ctest_num_suites++;
+        }
+        suite->remaining++;
+        res->suite = suite;
+    }
+    return 0;
+}
+
+// runs the suite setup before its first test, then gives the test a copy of
+// the shared data
+static void ctest_suite_enter(struct ctest_result* res) {
+    struct ctest_suite* suite = res->suite;
+    if (suite->state == CTEST_SUITE_IDLE) {
+        suite->state = CTEST_SUITE_FAILED;  // until the setup returns
+        suite->data = calloc(1, suite->datasize);
+        if (suite->data == NULL) CTEST_ERR("%s: out of memory for the suite data", suite->name);
+        if (suite->setup) {
+            ctest_timer_begin(&res->setup_ns);
+            suite->setup(suite->data);
+            ctest_timer_end();
+        }
+        suite->state = CTEST_SUITE_READY;
+    }
+    if (suite->state != CTEST_SUITE_READY) CTEST_ERR("%s: suite setup failed", suite->name);
+    memcpy(res->test->data, suite->data, suite->datasize);
+}
+
+static int ctest_suite_teardown(struct ctest_suite* suite, uint64_t* phase) {
+    volatile int status = CTEST_OK;
+    if (suite->state == CTEST_SUITE_READY && suite->teardown) {
+        if (setjmp(ctest_err) == 0) {
+            ctest_timer_begin(phase);
+            suite->teardown(suite->data);
+        } else {
+            status = CTEST_FAIL;
+        }
+        ctest_timer_end();
+    }
+    free(suite->data);
+    suite->data = NULL;
+    suite->state = CTEST_SUITE_DONE;
+    return status;
+}
+
+// tears the suite down after its last test, returns the status of the test
+static int ctest_suite_leave(struct ctest_result* res, int status) {
+    struct ctest_suite* suite = res->suite;
+    if (--suite->remaining > 0) return status;
+    return ctest_suite_teardown(suite, &res->teardown_ns) == CTEST_OK ? status : CTEST_FAIL;
+}
+
+#ifdef CTEST_IMPL_FORK
+// a worker may exit before it ran the last test of a suite
+static void ctest_suites_release(void) {
+    size_t i;
+    for (i = 0; i < ctest_num_suites; i++) {
+        if (ctest_suites[i].state == CTEST_SUITE_DONE) continue;
+        ctest_log_reset();
+        if (ctest_suite_teardown(&ctest_suites[i], NULL) != CTEST_OK) {
+            size_t len;
+            const char* log = ctest_log_text(&len);
+            fprintf(stderr, "%s: suite teardown failed\n%.*s", ctest_suites[i].name, (int) len, log);
+        }
+    }
+}
+#endif
+
+static uint64_t ctest_total_ns(const struct ctest_result* res) {
+    return res->setup_ns + res->run_ns + res->teardown_ns;
+}
+
+static uint64_t ctest_baseline_ns(const struct ctest* t);
+
+// fails a passing test that took longer than its budget or its baseline allows
+static int ctest_check_duration(const struct ctest_result* res) {
+    uint64_t ns = ctest_total_ns(res);
+    uint64_t base = ctest_baseline_ns(res->test);
+    char took[32];
+    char limit[32];
+    if (res->test->kind == CTEST_IMPL_KIND_BENCH) return CTEST_OK;
+    ctest_format_ns(took, sizeof(took), (double) ns);
+    if (res->test->budget_ms && ns > (uint64_t) res->test->budget_ms * 1000000u) {
+        msg_start("ERR");
+        print_errormsg("took %s, over its budget of %u ms", took, res->test->budget_ms);
+        msg_end();
+        return CTEST_FAIL;
+    }
+    if (base && ns > base + CTEST_BASELINE_MIN_NS && (double) ns > (double) base * (1 + ctest_tolerance / 100.0)) {
+        ctest_format_ns(limit, sizeof(limit), (double) base);
+        msg_start("ERR");
+        print_errormsg("took %s, %.0f%% slower than the baseline of %s (tolerance %d%%)", took,
+                       ((double) ns / (double) base - 1) * 100, limit, ctest_tolerance);
+        msg_end();
+        return CTEST_FAIL;
+    }
+    return CTEST_OK;
+}
+
+#ifdef CTEST_IMPL_FORK
+// benchmarks limit their own time
+static unsigned int ctest_test_timeout(const struct ctest* t) {
+    if (t->kind == CTEST_IMPL_KIND_BENCH) return 0;
+    return t->timeout_ms ? t->timeout_ms : ctest_timeout_ms;
+}
+#endif
+
+static int ctest_run_test(struct ctest_result* res) {
+    static struct ctest_heap_stats heap_before;
+    struct ctest* test = res->test;
+    ctest_log_reset();
+    __atomic_store_n(&ctest_thread_failures, 0, __ATOMIC_RELAXED);
+    res->setup_ns = res->run_ns = res->teardown_ns = 0;
+    res->prop_runs = res->prop_ns = 0;
+    ctest_prop_used = ctest_prop_arena_used = ctest_prop_replay = 0;
+    ctest_prop_active = ctest_prop_shrinking = 0;
+    ctest_assert_count = 0;
+    __atomic_store_n(&ctest_thread_asserts, 0, __ATOMIC_RELAXED);
+    if (test->skip) return CTEST_SKIP;
+
+    if (setjmp(ctest_err) != 0) {
+        uint64_t leaked_bytes;
+        ctest_timer_end();
+        ctest_heap_end(&leaked_bytes);
+        return res->suite ? ctest_suite_leave(res, CTEST_FAIL) : CTEST_FAIL;
+    }
+    if (res->suite) ctest_suite_enter(res);
+    // the suite setup is shared, its allocations aren't this test's
+    ctest_heap_snapshot(&heap_before);
+    ctest_heap_begin();
+    if (test->setup && *test->setup) {
+        ctest_timer_begin(&res->setup_ns);
+        (*test->setup)(test->data);
+        ctest_timer_end();
+    }
+    if (test->kind == CTEST_IMPL_KIND_BENCH) {
+        ctest_timer_begin(&res->run_ns);
+        ctest_run_bench(res);
+        ctest_timer_end();
+    } else if (test->kind == CTEST_IMPL_KIND_PROPERTY) {
+        ctest_perf_start();
+        ctest_timer_begin(&res->run_ns);
+        ctest_run_property(res);
+        ctest_timer_end();
+        ctest_perf_stop(&res->perf, res->prop_runs);
+    } else {
+        ctest_perf_start();
+        ctest_timer_begin(&res->run_ns);
+        if (test->num_cases)
+            test->run.param(test->case_index);
+        else if (test->data)
+            test->run.unary(test->data);
+        else
+            test->run.nullary();
+        ctest_timer_end();
+        ctest_perf_stop(&res->perf, 1);
+    }
+    if (test->teardown && *test->teardown) {
+        ctest_timer_begin(&res->teardown_ns);
+        (*test->teardown)(test->data);
+        ctest_timer_end();
+    }
+    // if we got here it's ok, unless it leaked
+    int status = ctest_heap_check(res, &heap_before);
+    if (__atomic_exchange_n(&ctest_thread_failures, 0, __ATOMIC_ACQUIRE) != 0) status = CTEST_FAIL;
+    if (status == CTEST_OK) status = ctest_check_duration(res);
+    return res->suite ? ctest_suite_leave(res, status) : status;
+}
+
+static void ctest_print_header(size_t idx) {
+    const struct ctest* test = ctest_pool->results[idx].test;
+    printf("TEST %d/%d %s:%s ", (int) idx + 1, (int) ctest_pool->count, test->ssname, test->ttname);
+}
+
+// IPC and misses per 1000 instructions, per operation for benchmarks
+static void ctest_print_perf(const struct ctest_perf_counts* perf) {
+    const uint64_t* v = perf->values;
+    double ops = perf->ops > 1 ? (double) perf->ops : 1;
+    const char* sep = "";
+    char buf[32];
+    unsigned int has_instr = perf->valid & (1u << CTEST_PERF_INSTRUCTIONS);
+    printf(" (");
+    if ((perf->valid & (1u << CTEST_PERF_CYCLES)) && has_instr && v[CTEST_PERF_CYCLES]) {
+        printf("IPC %.2f", (double) v[CTEST_PERF_INSTRUCTIONS] / (double) v[CTEST_PERF_CYCLES]);
+        sep = ", ";
+    }
+    if (perf->valid & (1u << CTEST_PERF_CYCLES)) {
+        printf("%s%s cycles", sep, ctest_format_count(buf, sizeof(buf), (double) v[CTEST_PERF_CYCLES] / ops));
+        sep = ", ";
+    }
+    if (has_instr) {
+        printf("%s%s instr", sep, ctest_format_count(buf, sizeof(buf), (double) v[CTEST_PERF_INSTRUCTIONS] / ops));
+        sep = ", ";
+    }
+    if ((perf->valid & (1u << CTEST_PERF_CACHE_MISSES)) && has_instr && v[CTEST_PERF_INSTRUCTIONS]) {
+        printf("%s%.2f cache-MPKI", sep, 1000.0 * (double) v[CTEST_PERF_CACHE_MISSES] / (double) v[CTEST_PERF_INSTRUCTIONS]);
+        sep = ", ";
+    }
+    if ((perf->valid & (1u << CTEST_PERF_BRANCH_MISSES)) && has_instr && v[CTEST_PERF_INSTRUCTIONS]) {
+        printf("%s%.2f branch-MPKI", sep, 1000.0 * (double) v[CTEST_PERF_BRANCH_MISSES] / (double) v[CTEST_PERF_INSTRUCTIONS]);
+        sep = ", ";
+    }
+    if (perf->valid & (1u << CTEST_PERF_PAGE_FAULTS)) {
+        printf("%s%s page faults", sep, ctest_format_count(buf, sizeof(buf), (double) v[CTEST_PERF_PAGE_FAULTS] / ops));
+    }
+    printf(perf->ops > 1 ? " per op)" : ")");
+}
+
+static void ctest_print_status(const char* color, const char* status, const struct ctest_result* res) {
+    if (color && color_output)
+        printf("%s%s" ANSI_NORMAL, color, status);
+    else
+        printf("%s", status);
+    if (res->status == CTEST_FAIL || res->status == CTEST_TIMEOUT) printf(" %s:%d", res->test->file, res->test->line);
+    if (res->test->kind == CTEST_IMPL_KIND_BENCH && res->status == CTEST_OK) {
+        const struct ctest_bench_stats* stats = &res->bench;
+        char buf[32];
+        printf(" %s/op", ctest_format_ns(buf, sizeof(buf), stats->mean));
+        printf(" (min %s", ctest_format_ns(buf, sizeof(buf), stats->min));
+        printf(", median %s", ctest_format_ns(buf, sizeof(buf), stats->median));
+        printf(", p99 %s", ctest_format_ns(buf, sizeof(buf), stats->p99));
+        printf(", stddev %s", ctest_format_ns(buf, sizeof(buf), stats->stddev));
+        printf(", %d x %" PRIu64 " iterations)", stats->samples, stats->iterations);
+    } else if (res->test->kind == CTEST_IMPL_KIND_PROPERTY && res->status == CTEST_OK) {
+        char buf[32];
+        printf(" %" PRIu64 " runs", res->prop_runs);
+        if (res->prop_ns) printf(", %s runs/s", ctest_format_count(buf, sizeof(buf), (double) res->prop_runs * 1e9 / (double) res->prop_ns));
+    } else if (ctest_show_time && res->status != CTEST_SKIP) {
+        char buf[32];
+        printf(" %s", ctest_format_ns(buf, sizeof(buf), (double) ctest_total_ns(res)));
+        if (res->setup_ns || res->teardown_ns) {
+            printf(" (setup %s", ctest_format_ns(buf, sizeof(buf), (double) res->setup_ns));
+            printf(", teardown %s)", ctest_format_ns(buf, sizeof(buf), (double) res->teardown_ns));
+        }
+    }
+    if (ctest_perf && res->perf.valid) ctest_print_perf(&res->perf);
+    if (ctest_show_allocs && res->status != CTEST_SKIP) {
+        printf(" (%" PRIu64 " allocs, %" PRIu64 " bytes)", res->allocs, res->alloc_bytes);
+    }
+    if (ctest_show_asserts && res->status != CTEST_SKIP) {
+        char buf[32];
+        const char* plural = res->asserts == 1 ? "" : "s";
+        if (res->asserts == 0) printf(" (no asserts)");
+        else if (res->run_ns == 0) printf(" (%" PRIu64 " assert%s)", res->asserts, plural);
+        else printf(" (%" PRIu64 " assert%s, %s/s)", res->asserts, plural,
+                    ctest_format_count(buf, sizeof(buf), (double) res->asserts * 1e9 / (double) res->run_ns));
+    }
+    printf("\n");
+}
+
+static const char* ctest_log_color(const char* line, size_t len, const char* color) {
+    if (len >= 7 && memcmp(line, "  ERR: ", 7) == 0) return ANSI_YELLOW;
+    if (len >= 7 && memcmp(line, "  LOG: ", 7) == 0) return ANSI_BLUE;
+    if (len >= 9 && memcmp(line, "  DEBUG: ", 9) == 0) return ANSI_GREY;
+    return color;   // the next line of a message
+}
+
+// logs are kept without colors, they are added here for the terminal
+static void ctest_print_log(const char* msg, size_t len) {
+    const char* end = msg + len;
+    const char* color = ANSI_NORMAL;
+    if (!color_output) {
+        fwrite(msg, 1, len, stdout);
+        return;
+    }
+    while (msg < end) {
+        const char* nl = (const char*) memchr(msg, '\n', (size_t) (end - msg));
+        size_t n = (size_t) ((nl ? nl : end) - msg);
+        color = ctest_log_color(msg, n, color);
+        printf("%s%.*s" ANSI_NORMAL "%s", color, (int) n, msg, nl ? "\n" : "");
+        msg += n + (nl != NULL);
+    }
+}
+
+static void ctest_print_result(const struct ctest_result* res, const char* msg, size_t msglen) {
+    ctest_num_asserts += res->asserts;
+    switch (res->status) {
+    case CTEST_OK:
+#ifdef CTEST_COLOR_OK
+        ctest_print_status(ANSI_BGREEN, "[OK]", res);
+#else
+        ctest_print_status(NULL, "[OK]", res);
+#endif
+        ctest_num_ok++;
+        break;
+    case CTEST_SKIP:
+        ctest_print_status(ANSI_BYELLOW, "[SKIPPED]", res);
+        ctest_num_skip++;
+        break;
+    case CTEST_TIMEOUT:
+        ctest_print_status(ANSI_BRED, "[TIMEOUT]", res);
+        ctest_num_fail++;
+        break;
+    default:
+        ctest_print_status(ANSI_BRED, "[FAIL]", res);
+        ctest_num_fail++;
+        break;
+    }
+    if (msglen) ctest_print_log(msg, msglen);
+}
+
+static int ctest_cmp_slowest(const void* a, const void* b) {
+    uint64_t ta = ctest_total_ns(*(const struct ctest_result* const*) a);
+    uint64_t tb = ctest_total_ns(*(const struct ctest_result* const*) b);
+    return (ta < tb) - (tb < ta);
+}
+
+static int ctest_cmp_suite(const void* a, const void* b) {
+    return strcmp((*(const struct ctest_result* const*) a)->test->ssname,
+                  (*(const struct ctest_result* const*) b)->test->ssname);
+}
+
+struct ctest_suite_time {
+    const char* ssname;
+    uint64_t ns;
+    size_t tests;
+};
+
+static int ctest_cmp_suite_time(const void* a, const void* b) {
+    uint64_t ta = ((const struct ctest_suite_time*) a)->ns;
+    uint64_t tb = ((const struct ctest_suite_time*) b)->ns;
+    return (ta < tb) - (tb < ta);
+}
+
+static void ctest_print_slowest(void) {
+    size_t count = ctest_pool->count;
+    size_t num = (size_t) ctest_num_slowest;
+    size_t i;
+    size_t num_suites = 0;
+    char buf[32];
+    struct ctest_result** sorted = (struct ctest_result**) malloc(count * sizeof(*sorted));
+    struct ctest_suite_time* suites = (struct ctest_suite_time*) malloc(count * sizeof(*suites));
+    if (count == 0 || sorted == NULL || suites == NULL) goto out;
+
+    for (i = 0; i < count; i++) sorted[i] = &ctest_pool->results[i];
+    qsort(sorted, count, sizeof(*sorted), ctest_cmp_slowest);
+    printf("SLOWEST TESTS:\n");
+    for (i = 0; i < count && i < num; i++) {
+        printf("  %10s  %s:%s\n", ctest_format_ns(buf, sizeof(buf), (double) ctest_total_ns(sorted[i])),
+               sorted[i]->test->ssname, sorted[i]->test->ttname);
+    }
+
+    qsort(sorted, count, sizeof(*sorted), ctest_cmp_suite);
+    for (i = 0; i < count; i++) {
+        if (num_suites == 0 || strcmp(suites[num_suites-1].ssname, sorted[i]->test->ssname) != 0) {
+            suites[num_suites].ssname = sorted[i]->test->ssname;
+            suites[num_suites].ns = 0;
+            suites[num_suites].tests = 0;
+            num_suites++;
+        }
+        suites[num_suites-1].ns += ctest_total_ns(sorted[i]);
+        suites[num_suites-1].tests++;
+    }
+    qsort(suites, num_suites, sizeof(*suites), ctest_cmp_suite_time);
+    printf("SLOWEST SUITES:\n");
+    for (i = 0; i < num_suites && i < num; i++) {
+        printf("  %10s  %s (%d tests)\n", ctest_format_ns(buf, sizeof(buf), (double) suites[i].ns),
+               suites[i].ssname, (int) suites[i].tests);
+    }
+out:
+    free(suites);
+    free(sorted);
+}
+
+static void ctest_shuffle_order(size_t* order, size_t count, uint64_t* state) {
+    size_t i;
+    for (i = count; i > 1; i--) {
+        size_t j = (size_t) (ctest_random(state) % i);
+        size_t t = order[i-1];
+        order[i-1] = order[j];
+        order[j] = t;
+    }
+}
+
+// after several rounds: the tests that failed at least once (all with --time)
+static void ctest_print_stats(size_t count, int rounds) {
+    size_t i;
+    int num_flaky = 0;
+    int num_failing = 0;
+    char mean[32];
+    char stddev[32];
+    printf("STATS: %d rounds\n", rounds);
+    printf("  %6s %6s %10s %10s  %s\n", "passed", "failed", "mean", "stddev", "test");
+    for (i = 0; i < count; i++) {
+        const struct ctest_test_stats* st = &ctest_stats[i];
+        uint32_t runs = st->passes + st->fails;
+        if (st->fails && st->passes) num_flaky++;
+        else if (st->fails) num_failing++;
+        if (runs == 0 || (st->fails == 0 && !ctest_show_time)) continue;
+        ctest_format_ns(mean, sizeof(mean), st->mean_ns);
+        ctest_format_ns(stddev, sizeof(stddev), runs > 1 ? ctest_sqrt(st->m2 / (runs - 1)) : 0);
+        printf("  %6u %6u %10s %10s  %s:%s%s\n", st->passes, st->fails, mean, stddev,
+               st->test->ssname, st->test->ttname, (st->fails && st->passes) ? "  FLAKY" : "");
+    }
+    printf("  %d flaky, %d failed every time\n", num_flaky, num_failing);
+}
+
+// Status and duration of every test from the previous runs, sorted by
+// ctest_hash_name(). Rewritten after every run, tests that didn't run keep
+// their old entry.
+struct ctest_history_entry {
+    uint64_t hash;
+    uint64_t ns;
+    uint32_t status;    // CTEST_OK or CTEST_FAIL
+    uint32_t reserved;
+};
+
+struct ctest_history_header {
+    char magic[8];
+    uint64_t count;
+};
+
+#define CTEST_HISTORY_MAGIC "ctesthi1"
+
+// a history file in memory (mmap'ed where possible)
+struct ctest_history_map {
+    const struct ctest_history_entry* entries;
+    size_t size;
+    void* data;
+    size_t data_size;
+};
+
+static const char* ctest_history_file;
+static char ctest_history_default[1024];
+static int ctest_no_history;
+static int ctest_failed_first;
+static int ctest_rerun_failed;
+static int ctest_slowest_first;
+static struct ctest_history_map ctest_history;
+static const char* ctest_baseline_file;     // --baseline, in the history format
+static const char* ctest_save_baseline_file;
+static struct ctest_history_map ctest_baseline;
+
+static void ctest_history_free(struct ctest_history_map* map) {
+    ctest_unmap_file(map->data, map->data_size);
+    memset(map, 0, sizeof(*map));
+}
+
+// returns 0 if the file was read, -1 if it's missing or invalid
+static int ctest_history_read(struct ctest_history_map* map, const char* filename) {
+    struct ctest_history_header header;
+    map->data = ctest_map_file(filename, &map->data_size);
+    if (map->data == NULL) return -1;
+    if (map->data_size < sizeof(header)) {
+        ctest_history_free(map);
+        return -1;
+    }
+    memcpy(&header, map->data, sizeof(header));
+    if (memcmp(header.magic, CTEST_HISTORY_MAGIC, sizeof(header.magic)) != 0 ||
+            header.count != (map->data_size - sizeof(header)) / sizeof(struct ctest_history_entry)) {
+        fprintf(stderr, "ctest: ignoring invalid history file '%s'\n", filename);
+        ctest_history_free(map);
+        return -1;
+    }
+    map->entries = (const struct ctest_history_entry*) ((const char*) map->data + sizeof(header));
+    map->size = (size_t) header.count;
+    return 0;
+}
+
+
+static void ctest_history_load(const char* progname) {
+    if (ctest_no_history) {
+        ctest_history_file = NULL;
+        return;
+    }
+    if (ctest_history_file == NULL) {
+        int n = snprintf(ctest_history_default, sizeof(ctest_history_default), "%s.ctest-history", progname);
+        if (n < 0 || (size_t) n >= sizeof(ctest_history_default)) return;
+        ctest_history_file = ctest_history_default;
+    }
+    ctest_history_read(&ctest_history, ctest_history_file);
+}
+
+static int ctest_cmp_history(const void* a, const void* b) {
+    uint64_t ha = ((const struct ctest_history_entry*) a)->hash;
+    uint64_t hb = ((const struct ctest_history_entry*) b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+static const struct ctest_history_entry* ctest_history_find(const struct ctest_history_map* map, const struct ctest* t) {
+    struct ctest_history_entry key;
+    if (map->size == 0) return NULL;
+    key.hash = ctest_hash_name(t);
+    return (const struct ctest_history_entry*) bsearch(&key, map->entries, map->size,
+                                                       sizeof(key), ctest_cmp_history);
+}
+
+struct ctest_shard_item {
+    struct ctest* test;
+    uint64_t hash;
+    uint64_t ns;
+    size_t pos;
+};
+
+// longest first, the name hash breaks ties so every shard sorts the same way
+static int ctest_cmp_shard_item(const void* a, const void* b) {
+    const struct ctest_shard_item* ia = (const struct ctest_shard_item*) a;
+    const struct ctest_shard_item* ib = (const struct ctest_shard_item*) b;
+    if (ia->ns != ib->ns) return ia->ns < ib->ns ? 1 : -1;
+    return (ia->hash > ib->hash) - (ia->hash < ib->hash);
+}
+
+// --shard-balance: tests with a duration in the history go, longest first, to
+// the shard with the least time so far. Tests without one are split by name
+// and count as the mean duration. All shards get the same split as long as
+// they select the same tests and read the same history. Returns the number
+// of tests kept, in their original order.
+static size_t ctest_shard_balance_tests(struct ctest** tests, size_t count) {
+    size_t i, j, num_known = 0, kept = 0;
+    uint64_t total_ns = 0, mean_ns;
+    uint64_t* loads = (uint64_t*) calloc((size_t) ctest_shard_count, sizeof(uint64_t));
+    struct ctest_shard_item* items = (struct ctest_shard_item*) malloc((count + 1) * sizeof(struct ctest_shard_item));
+    int* shard = (int*) malloc((count + 1) * sizeof(int));
+    if (loads == NULL || items == NULL || shard == NULL) {
+        fprintf(stderr, "ctest: out of memory, splitting the shards by name\n");
+        free(loads);
+        free(items);
+        free(shard);
+        ctest_shard_balance = 0;
+        for (i = 0; i < count; i++) {
+            if (ctest_in_shard(tests[i])) tests[kept++] = tests[i];
+        }
+        return kept;
+    }
+    for (i = 0; i < count; i++) {
+        const struct ctest_history_entry* e = ctest_history_find(&ctest_history, tests[i]);
+        uint64_t hash = ctest_hash_name(tests[i]);
+        shard[i] = (int) (hash % (uint64_t) ctest_shard_count);
+        if (e == NULL) continue;
+        items[num_known].test = tests[i];
+        items[num_known].hash = hash;
+        items[num_known].ns = e->ns;
+        items[num_known].pos = i;
+        num_known++;
+        total_ns += e->ns;
+    }
+    mean_ns = num_known ? total_ns / num_known : 0;
+    for (i = 0; i < count; i++) {
+        if (ctest_history_find(&ctest_history, tests[i]) == NULL) loads[shard[i]] += mean_ns;
+    }
+    qsort(items, num_known, sizeof(items[0]), ctest_cmp_shard_item);
+    for (i = 0; i < num_known; i++) {
+        int best = 0;
+        for (j = 1; j < (size_t) ctest_shard_count; j++) {
+            if (loads[j] < loads[best]) best = (int) j;
+        }
+        loads[best] += items[i].ns;
+        shard[items[i].pos] = best;
+    }
+    for (i = 0; i < count; i++) {
+        if (shard[i] == ctest_shard_index) tests[kept++] = tests[i];
+    }
+    free(loads);
+    free(items);
+    free(shard);
+    return kept;
+}
+
+static int ctest_history_failed(const struct ctest* t) {
+    const struct ctest_history_entry* e = ctest_history_find(&ctest_history, t);
+    return e && e->status == CTEST_FAIL;
+}
+
+static uint64_t ctest_baseline_ns(const struct ctest* t) {
+    const struct ctest_history_entry* e = ctest_history_find(&ctest_baseline, t);
+    return (e && e->status == CTEST_OK) ? e->ns : 0;
+}
+
+// merges this run into the old entries, writes them to a temporary file and
+// renames that over 'filename'
+static void ctest_history_write(const char* filename, const struct ctest_history_map* old) {
+    struct ctest_history_header header;
+    size_t num_new = 0;
+    size_t count = 0;
+    size_t i = 0;
+    size_t j = 0;
+    char tmpname[sizeof(ctest_history_default) + 8];
+    if (strlen(filename) >= sizeof(ctest_history_default)) {
+        fprintf(stderr, "ctest: file name too long '%s'\n", filename);
+        return;
+    }
+
+    struct ctest_history_entry* entries = (struct ctest_history_entry*) malloc(
+            (ctest_pool->count + 1) * sizeof(struct ctest_history_entry));
+    if (entries == NULL) return;
+    for (i = 0; i < ctest_pool->count; i++) {
+        const struct ctest_test_stats* st = &ctest_stats[i];
+        if (st->passes + st->fails == 0) continue;
+        entries[num_new].hash = ctest_hash_name(st->test);
+        entries[num_new].ns = (uint64_t) st->mean_ns;
+        entries[num_new].status = st->fails ? CTEST_FAIL : CTEST_OK;
+        entries[num_new].reserved = 0;
+        num_new++;
+    }
+    qsort(entries, num_new, sizeof(entries[0]), ctest_cmp_history);
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    FILE* f = fopen(tmpname, "wb");
+    if (f == NULL) goto fail;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CTEST_HISTORY_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, f);
+    i = 0;
+    while (i < old->size || j < num_new) {
+        const struct ctest_history_entry* e;
+        if (j == num_new || (i < old->size && old->entries[i].hash < entries[j].hash)) {
+            e = &old->entries[i++];
+        } else {
+            if (i < old->size && old->entries[i].hash == entries[j].hash) i++;
+            e = &entries[j++];
+        }
+        fwrite(e, sizeof(*e), 1, f);
+        count++;
+    }
+    header.count = count;
+    rewind(f);
+    fwrite(&header, sizeof(header), 1, f);
+    if (ferror(f) | fclose(f)) goto fail;
+#ifdef _WIN32
+    remove(filename);
+#endif
+    if (rename(tmpname, filename) != 0) goto fail;
+    free(entries);
+    return;
+fail:
+    remove(tmpname);
+    free(entries);
+    fprintf(stderr, "ctest: cannot write '%s'\n", filename);
+}
+
+static void ctest_history_save(void) {
+    if (ctest_history_file) ctest_history_write(ctest_history_file, &ctest_history);
+    if (ctest_save_baseline_file) {
+        struct ctest_history_map old;
+        memset(&old, 0, sizeof(old));
+        ctest_history_read(&old, ctest_save_baseline_file);
+        ctest_history_write(ctest_save_baseline_file, &old);
+        ctest_history_free(&old);
+    }
+}
+
+// --bench-save/--bench-compare: the samples (ns per iteration) of every
+// benchmark, in a text file with a line per benchmark: "suite:test n s1 .. sn"
+struct ctest_bench_entry {
+    const char* name;
+    int count;
+    double* samples;    // sorted
+};
+
+struct ctest_bench_set {
+    struct ctest_bench_entry* entries;
+    size_t size;
+    char* names;
+    double* samples;
+};
+
+#define CTEST_BENCH_FILE_HEADER "# ctest benchmark samples, ns per iteration\n"
+
+static void ctest_bench_set_free(struct ctest_bench_set* set) {
+    free(set->entries);
+    free(set->names);
+    free(set->samples);
+    memset(set, 0, sizeof(*set));
+}
+
+// the benchmarks of this run that passed
+static int ctest_bench_collect(struct ctest_bench_set* set) {
+    size_t count = ctest_pool->count;
+    size_t num = (size_t) ctest_bench_samples;
+    size_t names_size = 0;
+    size_t i;
+    memset(set, 0, sizeof(*set));
+    for (i = 0; i < count; i++) {
+        const struct ctest* t = ctest_pool->results[i].test;
+        names_size += strlen(t->ssname) + strlen(t->ttname) + 2;
+    }
+    set->entries = (struct ctest_bench_entry*) malloc((count + 1) * sizeof(struct ctest_bench_entry));
+    set->names = (char*) malloc(names_size + 1);
+    set->samples = (double*) malloc((count * num + 1) * sizeof(double));
+    if (set->entries == NULL || set->names == NULL || set->samples == NULL) {
+        ctest_bench_set_free(set);
+        return -1;
+    }
+    char* name = set->names;
+    for (i = 0; i < count; i++) {
+        const struct ctest_result* res = &ctest_pool->results[i];
+        if (res->test->kind != CTEST_IMPL_KIND_BENCH || res->status != CTEST_OK) continue;
+        struct ctest_bench_entry* e = &set->entries[set->size];
+        e->name = name;
+        name += snprintf(name, names_size + 1 - (size_t) (name - set->names), "%s:%s",
+                         res->test->ssname, res->test->ttname) + 1;
+        e->count = (int) num;
+        e->samples = set->samples + set->size * num;
+        memcpy(e->samples, ctest_bench_store + res->id * num, num * sizeof(double));
+        set->size++;
+    }
+    return 0;
+}
+
+static int ctest_bench_write(const char* filename, const struct ctest_bench_set* set) {
+    size_t i;
+    int j;
+    FILE* f = fopen(filename, "w");
+    if (f == NULL) return -1;
+    fputs(CTEST_BENCH_FILE_HEADER, f);
+    for (i = 0; i < set->size; i++) {
+        const struct ctest_bench_entry* e = &set->entries[i];
+        fprintf(f, "%s %d", e->name, e->count);
+        for (j = 0; j < e->count; j++) fprintf(f, " %.9g", e->samples[j]);
+        fputc('\n', f);
+    }
+    return (ferror(f) | fclose(f)) ? -1 : 0;
+}
+
+// returns 0 if the file was read, -1 if it's missing or invalid
+static int ctest_bench_read(struct ctest_bench_set* set, const char* filename) {
+    size_t size = 0;
+    size_t lines = 1;
+    size_t i;
+    memset(set, 0, sizeof(*set));
+    void* data = ctest_map_file(filename, &size);
+    if (data == NULL) return -1;
+    for (i = 0; i < size; i++) lines += ((const char*) data)[i] == '\n';
+    set->entries = (struct ctest_bench_entry*) malloc(lines * sizeof(struct ctest_bench_entry));
+    set->names = (char*) malloc(size + 1);
+    // a sample takes at least 2 characters
+    set->samples = (double*) malloc((size / 2 + 1) * sizeof(double));
+    if (set->entries == NULL || set->names == NULL || set->samples == NULL) {
+        ctest_unmap_file(data, size);
+        ctest_bench_set_free(set);
+        return -1;
+    }
+    memcpy(set->names, data, size);
+    set->names[size] = 0;
+    ctest_unmap_file(data, size);
+
+    char* p = set->names;
+    double* samples = set->samples;
+    while (*p) {
+        char* end = strchr(p, '\n');
+        if (end) *end = 0;
+        if (*p != '#' && *p != 0) {
+            struct ctest_bench_entry* e = &set->entries[set->size];
+            char* sep = strchr(p, ' ');
+            if (sep == NULL) goto invalid;
+            *sep = 0;
+            e->name = p;
+            e->count = (int) strtol(sep + 1, &p, 10);
+            e->samples = samples;
+            if (e->count < 1) goto invalid;
+            for (i = 0; i < (size_t) e->count; i++) {
+                char* num_end;
+                *samples++ = strtod(p, &num_end);
+                if (num_end == p) goto invalid;
+                p = num_end;
+            }
+            qsort(e->samples, (size_t) e->count, sizeof(double), ctest_cmp_double);
+            set->size++;
+        }
+        if (end == NULL) break;
+        p = end + 1;
+    }
+    return 0;
+invalid:
+    fprintf(stderr, "ctest: invalid benchmark file '%s'\n", filename);
+    ctest_bench_set_free(set);
+    return -1;
+}
+
+static const struct ctest_bench_entry* ctest_bench_find(const struct ctest_bench_set* set, const char* name) {
+    size_t i;
+    for (i = 0; i < set->size; i++) {
+        if (strcmp(set->entries[i].name, name) == 0) return &set->entries[i];
+    }
+    return NULL;
+}
+
+// e^x, precise enough for p-values (no libm)
+static double ctest_exp(double x) {
+    const double ln2 = 0.693147180559945309;
+    double sum = 1;
+    double term = 1;
+    int i;
+    if (x < -700) return 0;
+    int k = (int) (x / ln2 - 0.5);
+    double r = x - (double) k * ln2;
+    for (i = 1; i < 20; i++) {
+        term *= r / i;
+        sum += term;
+    }
+    for (; k < 0; k++) sum /= 2;
+    for (; k > 0; k--) sum *= 2;
+    return sum;
+}
+
+// two-sided p-value of a standard normal z (Abramowitz & Stegun 7.1.26)
+static double ctest_normal_p(double z) {
+    double x = (z < 0 ? -z : z) / 1.41421356237309505;
+    double t = 1 / (1 + 0.3275911 * x);
+    double poly = t * (0.254829592 + t * (-0.284496736 + t * (1.421413741 + t * (-1.453152027 + t * 1.061405429))));
+    return poly * ctest_exp(-x * x);
+}
+
+static double ctest_median(const double* sorted, size_t n) {
+    return (n % 2) ? sorted[n/2] : (sorted[n/2 - 1] + sorted[n/2]) / 2;
+}
+
+struct ctest_bench_diff {
+    double shift;   // Hodges-Lehmann estimate of new - old, ns
+    double low;     // its 95% confidence interval
+    double high;
+    double p;       // Mann-Whitney U test
+};
+
+// Mann-Whitney U test (normal approximation, corrected for ties) and the
+// Hodges-Lehmann shift, the median of all differences, with its distribution
+// free confidence interval
+static int ctest_bench_significance(const struct ctest_bench_entry* a, const struct ctest_bench_entry* b, struct ctest_bench_diff* d) {
+    size_t n = (size_t) a->count;
+    size_t m = (size_t) b->count;
+    size_t i = 0;
+    size_t j = 0;
+    double rank_sum = 0;    // of b
+    double ties = 0;
+    double* diffs = (double*) malloc(n * m * sizeof(double));
+    if (diffs == NULL) return -1;
+
+    while (i < n || j < m) {
+        double v = (j == m || (i < n && a->samples[i] <= b->samples[j])) ? a->samples[i] : b->samples[j];
+        size_t in_a = 0;
+        size_t in_b = 0;
+        while (i < n && a->samples[i] == v) { i++; in_a++; }
+        while (j < m && b->samples[j] == v) { j++; in_b++; }
+        double t = (double) (in_a + in_b);
+        // tied values share the mean of their ranks
+        rank_sum += (double) in_b * ((double) (i + j) - (t - 1) / 2);
+        ties += t * t * t - t;
+    }
+    double nm = (double) n * (double) m;
+    double total = (double) (n + m);
+    double u = rank_sum - (double) m * (double) (m + 1) / 2;
+    double var = nm / 12 * ((total + 1) - ties / (total * (total - 1)));
+    d->p = var > 0 ? ctest_normal_p((u - nm / 2) / ctest_sqrt(var)) : 1;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < m; j++) diffs[i * m + j] = b->samples[j] - a->samples[i];
+    }
+    qsort(diffs, n * m, sizeof(double), ctest_cmp_double);
+    d->shift = ctest_median(diffs, n * m);
+    double k = nm / 2 - 1.96 * ctest_sqrt(nm * (total + 1) / 12);
+    size_t lo = k >= 1 ? (size_t) k - 1 : 0;
+    d->low = diffs[lo];
+    d->high = diffs[n * m - 1 - lo];
+    free(diffs);
+    return 0;
+}
+
+// a line per benchmark of 'now' that's also in 'base': the change of the
+// median and whether it's significant, or noise
+static void ctest_bench_compare(const struct ctest_bench_set* base, const struct ctest_bench_set* now,
+                                const char* base_name, const char* now_name) {
+    int width = 0;
+    size_t i;
+    char buf1[32];
+    char buf2[32];
+    for (i = 0; i < now->size; i++) {
+        int len = (int) strlen(now->entries[i].name);
+        if (len > width) width = len;
+    }
+    printf("BENCH COMPARE: %s -> %s\n", base_name, now_name);
+    for (i = 0; i < now->size; i++) {
+        const struct ctest_bench_entry* e = &now->entries[i];
+        const struct ctest_bench_entry* old = ctest_bench_find(base, e->name);
+        struct ctest_bench_diff d;
+        printf("  %-*s  ", width, e->name);
+        if (old == NULL) {
+            printf("(new)\n");
+            continue;
+        }
+        double old_median = ctest_median(old->samples, (size_t) old->count);
+        printf("%10s -> %10s", ctest_format_ns(buf1, sizeof(buf1), old_median),
+               ctest_format_ns(buf2, sizeof(buf2), ctest_median(e->samples, (size_t) e->count)));
+        if (ctest_bench_significance(old, e, &d) != 0 || old_median <= 0) {
+            printf("\n");
+            continue;
+        }
+        printf("  %+6.1f%% [%+.1f%%, %+.1f%%]  p=%.3f  ", 100 * d.shift / old_median,
+               100 * d.low / old_median, 100 * d.high / old_median, d.p);
+        if (d.p >= 0.05 || (d.low <= 0 && d.high >= 0)) {
+            printf("~ noise\n");
+        } else if (d.shift < 0) {
+            color_print(ANSI_BGREEN, "faster");
+        } else {
+            color_print(ANSI_BRED, "slower");
+        }
+    }
+}
+
+// --bench-compare=OLD,NEW compares two saved files instead of running
+static int ctest_bench_compare_files(const char* names) {
+    struct ctest_bench_set base;
+    struct ctest_bench_set now;
+    const char* comma = strchr(names, ',');
+    size_t len = (size_t) (comma - names);
+    char* base_name = (char*) malloc(len + 1);
+    if (base_name == NULL) return 1;
+    memcpy(base_name, names, len);
+    base_name[len] = 0;
+    int ret = 1;
+    if (ctest_bench_read(&base, base_name) != 0) {
+        fprintf(stderr, "cannot read benchmarks '%s'\n", base_name);
+    } else {
+        if (ctest_bench_read(&now, comma + 1) != 0) {
+            fprintf(stderr, "cannot read benchmarks '%s'\n", comma + 1);
+        } else {
+            ctest_bench_compare(&base, &now, base_name, comma + 1);
+            ctest_bench_set_free(&now);
+            ret = 0;
+        }
+        ctest_bench_set_free(&base);
+    }
+    free(base_name);
+    return ret;
+}
+
+// after a --bench run
+static void ctest_bench_report(void) {
+    struct ctest_bench_set now;
+    struct ctest_bench_set base;
+    if (ctest_bench_store == NULL || ctest_bench_collect(&now) != 0) return;
+    if (ctest_bench_compare_file) {
+        if (ctest_bench_read(&base, ctest_bench_compare_file) == 0) {
+            ctest_bench_compare(&base, &now, ctest_bench_compare_file, "this run");
+            ctest_bench_set_free(&base);
+        } else {
+            fprintf(stderr, "ctest: cannot read benchmarks '%s'\n", ctest_bench_compare_file);
+        }
+    }
+    if (ctest_bench_save_file && ctest_bench_write(ctest_bench_save_file, &now) != 0) {
+        fprintf(stderr, "ctest: cannot write '%s'\n", ctest_bench_save_file);
+    }
+    ctest_bench_set_free(&now);
+}
+
+struct ctest_order {
+    struct ctest* test;
+    uint64_t ns;    // UINT64_MAX for new tests
+    int failed;
+    size_t pos;
+};
+
+static int ctest_cmp_order(const void* a, const void* b) {
+    const struct ctest_order* oa = (const struct ctest_order*) a;
+    const struct ctest_order* ob = (const struct ctest_order*) b;
+    if (ctest_failed_first && oa->failed != ob->failed) return ob->failed - oa->failed;
+    if (ctest_slowest_first && oa->ns != ob->ns) return oa->ns < ob->ns ? 1 : -1;
+    return (oa->pos > ob->pos) - (oa->pos < ob->pos);
+}
+
+// --failed-first and --slowest-first, new tests count as slowest
+static void ctest_order_tests(struct ctest** tests, size_t count) {
+    size_t i;
+    if (!ctest_failed_first && !ctest_slowest_first) return;
+    struct ctest_order* order = (struct ctest_order*) malloc((count + 1) * sizeof(struct ctest_order));
+    if (order == NULL) return;
+    for (i = 0; i < count; i++) {
+        const struct ctest_history_entry* e = ctest_history_find(&ctest_history, tests[i]);
+        order[i].test = tests[i];
+        order[i].ns = e ? e->ns : (tests[i]->skip ? 0 : UINT64_MAX);
+        order[i].failed = e && e->status == CTEST_FAIL;
+        order[i].pos = i;
+    }
+    qsort(order, count, sizeof(order[0]), ctest_cmp_order);
+    for (i = 0; i < count; i++) tests[i] = order[i].test;
+    free(order);
+}
+
+// machine readable reports, written next to the normal output
+struct ctest_reporter {
+    const char* option;
+    void (*begin)(struct ctest_reporter* r);
+    void (*test)(struct ctest_reporter* r, size_t idx, const struct ctest_result* res, const char* msg, size_t msglen);
+    void (*end)(struct ctest_reporter* r, uint64_t elapsed_ns);
+    const char* filename;
+    FILE* file;
+    int seekable;
+};
+
+static const char* ctest_status_name(int status) {
+    switch (status) {
+    case CTEST_OK: return "ok";
+    case CTEST_SKIP: return "skip";
+    case CTEST_TIMEOUT: return "timeout";
+    default: return "fail";
+    }
+}
+
+enum {
+    CTEST_ESCAPE_XML,
+    CTEST_ESCAPE_JSON,
+    CTEST_ESCAPE_TAP
+};
+
+// writes test output without the color codes, escaped for the report format
+static void ctest_write_escaped(FILE* f, const char* msg, size_t len, int format) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        char c = msg[i];
+        if (c == '\033' && i + 1 < len && msg[i+1] == '[') {
+            i += 2;
+            while (i < len && !((msg[i] >= 'a' && msg[i] <= 'z') || (msg[i] >= 'A' && msg[i] <= 'Z'))) i++;
+            continue;
+        }
+        if (format == CTEST_ESCAPE_XML) {
+            if (c == '<') fputs("&lt;", f);
+            else if (c == '>') fputs("&gt;", f);
+            else if (c == '&') fputs("&amp;", f);
+            else if (c == '"') fputs("&quot;", f);
+            else if ((unsigned char) c < 0x20 && c != '\n' && c != '\t') fputc('?', f);
+            else fputc(c, f);
+        } else if (format == CTEST_ESCAPE_JSON) {
+            if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+            else if (c == '\n') fputs("\\n", f);
+            else if (c == '\t') fputs("\\t", f);
+            else if ((unsigned char) c < 0x20) fprintf(f, "\\u%04x", (unsigned) c);
+            else fputc(c, f);
+        } else {
+            fputc(c, f);
+            if (c == '\n' && i + 1 < len) fputs("    ", f);
+        }
+    }
+}
+
+#define CTEST_JUNIT_TAIL "</testsuite>\n</testsuites>\n"
+
+static void ctest_junit_header(FILE* f, uint64_t elapsed_ns) {
+    char header[128];
+    snprintf(header, sizeof(header), "<testsuite name=\"ctest\" tests=\"%d\" failures=\"%d\" skipped=\"%d\" assertions=\"%" PRIu64 "\" time=\"%.6f\"",
+             ctest_num_ok + ctest_num_fail + ctest_num_skip, ctest_num_fail, ctest_num_skip, ctest_num_asserts, (double) elapsed_ns / 1e9);
+    // padded so it can be rewritten in place when the totals are known
+    fprintf(f, "%-127s>\n", header);
+}
+
+static void ctest_junit_begin(struct ctest_reporter* r) {
+    FILE* f = r->file;
+    fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n");
+    ctest_junit_header(f, 0);
+    if (ctest_shard_count) {
+        fprintf(f, "  <properties><property name=\"shard\" value=\"%d/%d\"/></properties>\n",
+                ctest_shard_index, ctest_shard_count);
+    }
+}
+
+// The closing tags are written after every test and then overwritten by the
+// next one, so the file is always a complete document.
+static void ctest_junit_test(struct ctest_reporter* r, size_t idx, const struct ctest_result* res, const char* msg, size_t msglen) {
+    FILE* f = r->file;
+    int failed = res->status == CTEST_FAIL || res->status == CTEST_TIMEOUT;
+    const char* tag = failed ? "failure" : "system-out";
+    (void) idx;
+    fprintf(f, "  <testcase classname=\"");
+    ctest_write_escaped(f, res->test->ssname, strlen(res->test->ssname), CTEST_ESCAPE_XML);
+    fprintf(f, "\" name=\"");
+    ctest_write_escaped(f, res->test->ttname, strlen(res->test->ttname), CTEST_ESCAPE_XML);
+    fprintf(f, "\" file=\"");
+    ctest_write_escaped(f, res->test->file, strlen(res->test->file), CTEST_ESCAPE_XML);
+    fprintf(f, "\" line=\"%d\" assertions=\"%" PRIu64 "\" time=\"%.6f\">", res->test->line, res->asserts,
+            (double) ctest_total_ns(res) / 1e9);
+    if (res->status == CTEST_SKIP) fprintf(f, "<skipped/>");
+    if (failed || msglen) {
+        fprintf(f, "\n    <%s>", tag);
+        ctest_write_escaped(f, msg, msglen, CTEST_ESCAPE_XML);
+        fprintf(f, "</%s>\n  ", tag);
+    }
+    fprintf(f, "</testcase>\n");
+    if (r->seekable) {
+        fputs(CTEST_JUNIT_TAIL, f);
+        fseek(f, -(long) strlen(CTEST_JUNIT_TAIL), SEEK_CUR);
+    }
+}
+
+static void ctest_junit_end(struct ctest_reporter* r, uint64_t elapsed_ns) {
+    FILE* f = r->file;
+    fputs(CTEST_JUNIT_TAIL, f);
+    if (r->seekable && fseek(f, 0, SEEK_SET) == 0) {
+        fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n");
+        ctest_junit_header(f, elapsed_ns);
+    }
+}
+
+static void ctest_json_begin(struct ctest_reporter* r) {
+    (void) r;
+}
+
+static void ctest_json_test(struct ctest_reporter* r, size_t idx, const struct ctest_result* res, const char* msg, size_t msglen) {
+    FILE* f = r->file;
+    fprintf(f, "{\"type\":\"test\",\"index\":%d,", (int) idx + 1);
+    if (ctest_max_rounds != 1) fprintf(f, "\"round\":%d,", ctest_round);
+    if (ctest_shard_count) fprintf(f, "\"shard\":\"%d/%d\",", ctest_shard_index, ctest_shard_count);
+    fprintf(f, "\"suite\":\"");
+    ctest_write_escaped(f, res->test->ssname, strlen(res->test->ssname), CTEST_ESCAPE_JSON);
+    fprintf(f, "\",\"test\":\"");
+    ctest_write_escaped(f, res->test->ttname, strlen(res->test->ttname), CTEST_ESCAPE_JSON);
+    fprintf(f, "\",\"file\":\"");
+    ctest_write_escaped(f, res->test->file, strlen(res->test->file), CTEST_ESCAPE_JSON);
+    fprintf(f, "\",\"line\":%d,\"status\":\"%s\",\"duration_ns\":%" PRIu64 ",\"setup_ns\":%" PRIu64 ",\"teardown_ns\":%" PRIu64
+               ",\"asserts\":%" PRIu64,
+            res->test->line, ctest_status_name(res->status), ctest_total_ns(res), res->setup_ns, res->teardown_ns, res->asserts);
+    if (res->test->kind == CTEST_IMPL_KIND_BENCH && res->status == CTEST_OK) {
+        const struct ctest_bench_stats* stats = &res->bench;
+        fprintf(f, ",\"bench\":{\"mean_ns\":%.3f,\"min_ns\":%.3f,\"median_ns\":%.3f,\"p99_ns\":%.3f,"
+                   "\"stddev_ns\":%.3f,\"samples\":%d,\"iterations\":%" PRIu64 "}",
+                stats->mean, stats->min, stats->median, stats->p99, stats->stddev, stats->samples, stats->iterations);
+    }
+    if (res->test->kind == CTEST_IMPL_KIND_PROPERTY && res->status != CTEST_SKIP) {
+        fprintf(f, ",\"property\":{\"runs\":%" PRIu64 ",\"ns\":%" PRIu64 ",\"seed\":%" PRIu64 "}",
+                res->prop_runs, res->prop_ns, ctest_prop_seed);
+    }
+    if (res->perf.valid) {
+        static const char* const names[CTEST_PERF_NUM] = {
+            "cycles", "instructions", "cache_misses", "branch_misses", "page_faults"
+        };
+        int i;
+        fprintf(f, ",\"perf\":{\"ops\":%" PRIu64, res->perf.ops);
+        for (i = 0; i < CTEST_PERF_NUM; i++) {
+            if (res->perf.valid & (1u << i)) fprintf(f, ",\"%s\":%" PRIu64, names[i], res->perf.values[i]);
+        }
+        fprintf(f, "}");
+    }
+#ifdef CTEST_MALLOC
+    fprintf(f, ",\"allocs\":%" PRIu64 ",\"alloc_bytes\":%" PRIu64, res->allocs, res->alloc_bytes);
+#endif
+    fprintf(f, ",\"output\":\"");
+    ctest_write_escaped(f, msg, msglen, CTEST_ESCAPE_JSON);
+    fprintf(f, "\"}\n");
+}
+
+static void ctest_json_end(struct ctest_reporter* r, uint64_t elapsed_ns) {
+    FILE* f = r->file;
+    fprintf(f, "{\"type\":\"summary\",\"tests\":%d,\"ok\":%d,\"failed\":%d,\"skipped\":%d,\"asserts\":%" PRIu64 ",\"duration_ns\":%" PRIu64,
+            ctest_num_ok + ctest_num_fail + ctest_num_skip, ctest_num_ok, ctest_num_fail, ctest_num_skip, ctest_num_asserts, elapsed_ns);
+    if (ctest_shard_count) fprintf(f, ",\"shard\":\"%d/%d\"", ctest_shard_index, ctest_shard_count);
+    fprintf(f, "}\n");
+}
+
+static int ctest_tap_num;
+
+// without a fixed number of rounds the plan goes at the end
+static void ctest_tap_begin(struct ctest_reporter* r) {
+    FILE* f = r->file;
+    fprintf(f, "TAP version 13\n");
+    if (ctest_max_rounds) fprintf(f, "1..%d\n", (int) ctest_pool->count * ctest_max_rounds);
+    if (ctest_shard_count) fprintf(f, "# shard %d/%d\n", ctest_shard_index, ctest_shard_count);
+}
+
+static void ctest_tap_test(struct ctest_reporter* r, size_t idx, const struct ctest_result* res, const char* msg, size_t msglen) {
+    FILE* f = r->file;
+    (void) idx;
+    int failed = res->status == CTEST_FAIL || res->status == CTEST_TIMEOUT;
+    fprintf(f, "%s %d - %s:%s%s\n", failed ? "not ok" : "ok", ++ctest_tap_num,
+            res->test->ssname, res->test->ttname, res->status == CTEST_SKIP ? " # SKIP" : "");
+    if (res->status == CTEST_SKIP) return;
+    fprintf(f, "  ---\n  at: %s:%d\n  duration_ms: %.3f\n  asserts: %" PRIu64 "\n", res->test->file, res->test->line,
+            (double) ctest_total_ns(res) / 1e6, res->asserts);
+    if (msglen) {
+        fprintf(f, "  output: |\n    ");
+        ctest_write_escaped(f, msg, msglen, CTEST_ESCAPE_TAP);
+    }
+    fprintf(f, "  ...\n");
+}
+
+static void ctest_tap_end(struct ctest_reporter* r, uint64_t elapsed_ns) {
+    (void) elapsed_ns;
+    if (ctest_max_rounds == 0) fprintf(r->file, "1..%d\n", ctest_tap_num);
+}
+
+static struct ctest_reporter ctest_reporters[] = {
+    { "--junit", ctest_junit_begin, ctest_junit_test, ctest_junit_end, NULL, NULL, 0 },
+    { "--json", ctest_json_begin, ctest_json_test, ctest_json_end, NULL, NULL, 0 },
+    { "--tap", ctest_tap_begin, ctest_tap_test, ctest_tap_end, NULL, NULL, 0 },
+};
+#define CTEST_NUM_REPORTERS (sizeof(ctest_reporters) / sizeof(ctest_reporters[0]))
+
+static int ctest_reporters_open(void) {
+    size_t i;
+    for (i = 0; i < CTEST_NUM_REPORTERS; i++) {
+        struct ctest_reporter* r = &ctest_reporters[i];
+        if (r->filename == NULL) continue;
+        r->file = fopen(r->filename, "w");
+        if (r->file == NULL) {
+            perror(r->filename);
+            return -1;
+        }
+        setvbuf(r->file, NULL, _IOFBF, 64 * 1024);
+        r->seekable = ftell(r->file) >= 0 && fseek(r->file, 0, SEEK_CUR) == 0;
+        r->begin(r);
+        fflush(r->file);
+    }
+    return 0;
+}
+
+static void ctest_reporters_flush(void) {
+    size_t i;
+    for (i = 0; i < CTEST_NUM_REPORTERS; i++) {
+        if (ctest_reporters[i].file) fflush(ctest_reporters[i].file);
+    }
+}
+
+static void ctest_reporters_close(uint64_t elapsed_ns) {
+    size_t i;
+    for (i = 0; i < CTEST_NUM_REPORTERS; i++) {
+        struct ctest_reporter* r = &ctest_reporters[i];
+        if (r->file == NULL) continue;
+        r->end(r, elapsed_ns);
+        fclose(r->file);
+        r->file = NULL;
+    }
+}
+
+// prints the result of a test and adds it to the reports
+static void ctest_report(size_t idx, const char* msg, size_t msglen) {
+    const struct ctest_result* res = &ctest_pool->results[idx];
+    struct ctest_test_stats* st = &ctest_stats[res->id];
+    size_t i;
+    ctest_print_result(res, msg, msglen);
+    if (res->status != CTEST_SKIP) {
+        double ns = (double) ctest_total_ns(res);
+        double delta = ns - st->mean_ns;
+        if (res->status == CTEST_OK) st->passes++;
+        else st->fails++;
+        st->mean_ns += delta / (st->passes + st->fails);
+        st->m2 += delta * (ns - st->mean_ns);
+    }
+    for (i = 0; i < CTEST_NUM_REPORTERS; i++) {
+        struct ctest_reporter* r = &ctest_reporters[i];
+        if (r->file) r->test(r, idx, res, msg, msglen);
+    }
+}
+
+#ifdef CTEST_IMPL_FORK
+#define CTEST_TIMEOUT_GRACE_MS 100  // for a timed out test to reach a log call
+static pthread_t ctest_runner;
+
+static void ctest_sigalrm(int signum) {
+    if (!ctest_is_runner) {
+        // a thread of the test got it, only the runner can jump out
+        pthread_kill(ctest_runner, signum);
+        return;
+    }
+    if (!ctest_timeout_pending) {
+        ctest_timeout_pending = 1;
+        return;
+    }
+    // the grace period is over, unless a log call is about to jump
+    if (!ctest_in_log) siglongjmp(ctest_timeout_jmp, 2);
+}
+
+// the alarm repeats every CTEST_TIMEOUT_GRACE_MS after the first
+static void ctest_set_alarm(unsigned int ms) {
+    struct itimerval it;
+    memset(&it, 0, sizeof(it));
+    it.it_value.tv_sec = ms / 1000;
+    it.it_value.tv_usec = (ms % 1000) * 1000;
+    if (ms) it.it_interval.tv_usec = CTEST_TIMEOUT_GRACE_MS * 1000;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+// only write() is safe after leaving a test from a signal handler
+static void ctest_write_str(const char* str) {
+    ssize_t r = write(STDOUT_FILENO, str, strlen(str));
+    (void) r;
+}
+
+static void ctest_write_uint(uint64_t value) {
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    do {
+        *--p = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value);
+    ssize_t r = write(STDOUT_FILENO, p, (size_t) (buf + sizeof(buf) - p));
+    (void) r;
+}
+
+// A test that didn't reach a log call within the grace period was left from
+// wherever it was, maybe holding the locks of malloc or stdio. So it's
+// reported with write() only, with the start of its log, and the run ends
+// like after a crash. The reports have the tests before it
+static void ctest_hung(const struct ctest_result* res) {
+    size_t used = __atomic_load_n(&ctest_errorused, __ATOMIC_RELAXED);
+    size_t len = used < MSG_SIZE ? used : MSG_SIZE;
+    if (len == MSG_SIZE) {
+        while (len > 0 && ctest_errorfirst[len - 1] != '\n') len--;
+    }
+    ctest_write_str(color_output ? ANSI_BRED "[TIMEOUT]" ANSI_NORMAL "\n" : "[TIMEOUT]\n");
+    ssize_t r = write(STDOUT_FILENO, ctest_errorfirst, len);
+    (void) r;
+    ctest_write_str("  ERR: timed out (timeout ");
+    ctest_write_uint(ctest_test_timeout(res->test));
+    ctest_write_str(" ms), not at a log call\nTIMEOUT: ");
+    ctest_write_str(res->test->ssname);
+    ctest_write_str(":");
+    ctest_write_str(res->test->ttname);
+    ctest_write_str(" hung, stopping with ");
+    ctest_write_uint((uint64_t) (ctest_pool->results + ctest_pool->count - res - 1));
+    ctest_write_str(" test(s) not run\n");
+    _exit(1);
+}
+
+// Without workers a hung test can only be left by jumping out of it. From a
+// log call that's like a failed assertion, so the run goes on. A test that
+// doesn't log within the grace period ends the run, see ctest_hung()
+static int ctest_run_watched(struct ctest_result* res) {
+    if (ctest_test_timeout(res->test) == 0) return ctest_run_test(res);
+    int jumped = sigsetjmp(ctest_timeout_jmp, 1);
+    if (jumped == 2) ctest_hung(res);
+    if (jumped != 0) {
+        char took[32];
+        ctest_set_alarm(0);
+        ctest_timeout_pending = 0;
+        ctest_timer_end();
+        ctest_format_ns(took, sizeof(took), (double) ctest_total_ns(res));
+        msg_start("ERR");
+        print_errormsg("timed out after %s (timeout %u ms)", took, ctest_test_timeout(res->test));
+        msg_end();
+        return res->suite ? ctest_suite_leave(res, CTEST_TIMEOUT) : CTEST_TIMEOUT;
+    }
+    ctest_set_alarm(ctest_test_timeout(res->test));
+    int status = ctest_run_test(res);
+    ctest_set_alarm(0);
+    ctest_timeout_pending = 0;
+    return status;
+}
+#endif
+
+static void ctest_run_serial(void) {
+    size_t i;
+#ifdef CTEST_IMPL_FORK
+    struct sigaction sa;
+    struct sigaction old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ctest_sigalrm;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, &old_sa);
+#endif
+    for (i = 0; i < ctest_pool->count; i++) {
+        struct ctest_result* res = &ctest_pool->results[i];
+        ctest_print_header(i);
+        fflush(stdout);
+#ifdef CTEST_IMPL_FORK
+        res->status = ctest_run_watched(res);
+#else
+        res->status = ctest_run_test(res);
+#endif
+        res->asserts = ctest_test_asserts();
+        size_t len;
+        const char* log = ctest_log_text(&len);
+        ctest_report(i, log, len);
+        // a crash in the next test should not lose this one
+        ctest_reporters_flush();
+    }
+#ifdef CTEST_IMPL_FORK
+    sigaction(SIGALRM, &old_sa, NULL);
+#endif
+}
+
+#ifdef CTEST_IMPL_FORK
+static int ctest_notify_fd = -1;
+
+// wakes up the parent when a worker exits, see ctest_run_parallel(). The
+// pipe doesn't block: when it's full the parent has wakeups waiting already
+static void ctest_sigchld(int signum) {
+    const size_t wakeup = SIZE_MAX;
+    int saved_errno = errno;
+    ssize_t r = write(ctest_notify_fd, &wakeup, sizeof(wakeup));
+    (void) r;
+    (void) signum;
+    errno = saved_errno;
+}
+
+static void ctest_worker_loop(struct ctest_worker* worker) {
+    int num_run;
+    for (num_run = 0; ctest_isolate == 0 || num_run < ctest_isolate; num_run++) {
+        size_t i = __atomic_fetch_add(&ctest_pool->next, 1, __ATOMIC_RELAXED);
+        if (i >= ctest_pool->count) break;
+
+        struct ctest_result* res = &ctest_pool->results[i];
+        ssize_t r;
+        worker->started_ns = ctest_now_ns();
+        __atomic_store_n(&worker->current, i, __ATOMIC_RELEASE);
+        // so the parent starts watching the time
+        if (ctest_test_timeout(res->test)) r = write(ctest_notify_fd, &i, sizeof(i));
+        int status = ctest_run_test(res);
+        res->asserts = ctest_test_asserts();
+        size_t len;
+        const char* log = ctest_log_text(&len);
+        ctest_save_msg(res, log, len);
+        // fails if the parent gave up on the test, it is about to kill us
+        int pending = CTEST_PENDING;
+        if (!__atomic_compare_exchange_n(&res->status, &pending, status, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) break;
+        worker->current = SIZE_MAX;
+
+        r = write(ctest_notify_fd, &i, sizeof(i));
+        (void) r;
+    }
+}
+
+static int ctest_spawn_worker(struct ctest_worker* worker, int readfd) {
+    worker->current = SIZE_MAX;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        // crashes are reported by the parent
+        signal(SIGSEGV, SIG_DFL);
+        close(readfd);
+        ctest_errorfirst = worker->log;
+        ctest_worker_loop(worker);
+        ctest_suites_release();
+        _exit(0);
+    }
+    if (pid < 0) return -1;
+    worker->pid = pid;
+    return 0;
+}
+
+static const char* ctest_signal_name(int signum) {
+    switch (signum) {
+    case SIGSEGV: return "SIGSEGV: Segmentation fault";
+    case SIGABRT: return "SIGABRT: Aborted";
+    case SIGBUS: return "SIGBUS: Bus error";
+    case SIGFPE: return "SIGFPE: Floating point exception";
+    case SIGILL: return "SIGILL: Illegal instruction";
+    case SIGTRAP: return "SIGTRAP: Trace/breakpoint trap";
+    case SIGKILL: return "SIGKILL: Killed";
+    case SIGTERM: return "SIGTERM: Terminated";
+    case SIGINT: return "SIGINT: Interrupt";
+    case SIGPIPE: return "SIGPIPE: Broken pipe";
+    case SIGALRM: return "SIGALRM: Alarm clock";
+    default: return NULL;
+    }
+}
+
+// the log a worker left behind, up to the last complete message when it
+// filled the first chunk
+static size_t ctest_worker_log(const struct ctest_worker* worker, char* msg) {
+    size_t len = strnlen(worker->log, MSG_SIZE - 1);
+    if (len == MSG_SIZE - 1) {
+        while (len > 0 && worker->log[len - 1] != '\n') len--;
+    }
+    memcpy(msg, worker->log, len);
+    return len;
+}
+
+// fails the test a worker was running when it died, keeping its output
+static void ctest_worker_died(struct ctest_worker* worker, struct ctest_result* res, int wstatus) {
+    char msg[MSG_SIZE + 128];
+    size_t len = ctest_worker_log(worker, msg);
+    if (WIFSIGNALED(wstatus)) {
+        const char* name = ctest_signal_name(WTERMSIG(wstatus));
+        if (name) snprintf(msg + len, sizeof(msg) - len, "  ERR: crashed [%s]\n", name);
+        else snprintf(msg + len, sizeof(msg) - len, "  ERR: crashed [signal %d]\n", WTERMSIG(wstatus));
+    } else if (WEXITSTATUS(wstatus) != 0) {
+        snprintf(msg + len, sizeof(msg) - len, "  ERR: exited with status %d\n", WEXITSTATUS(wstatus));
+    } else {
+        snprintf(msg + len, sizeof(msg) - len, "  ERR: exited during the test\n");
+    }
+    ctest_save_msg(res, msg, strlen(msg));
+    res->status = CTEST_FAIL;
+}
+
+// a worker that ran out of time is killed, the output of the test is kept
+static void ctest_worker_timed_out(struct ctest_worker* worker, struct ctest_result* res, uint64_t now) {
+    char msg[MSG_SIZE + 128];
+    char took[32];
+    size_t len = ctest_worker_log(worker, msg);
+    res->setup_ns = res->teardown_ns = 0;
+    res->run_ns = now - worker->started_ns;
+    ctest_format_ns(took, sizeof(took), (double) res->run_ns);
+    snprintf(msg + len, sizeof(msg) - len, "  ERR: timed out after %s (timeout %u ms), killed\n",
+             took, ctest_test_timeout(res->test));
+    ctest_save_msg(res, msg, strlen(msg));
+}
+
+// kills the workers whose test is over its timeout and replaces them.
+// Returns the ms until the next timeout, -1 if there is none
+static int ctest_check_timeouts(int readfd) {
+    uint64_t now = ctest_now_ns();
+    int wait_ms = -1;
+    int id;
+    for (id = 0; id < ctest_jobs; id++) {
+        struct ctest_worker* worker = &ctest_pool->workers[id];
+        size_t current = __atomic_load_n(&worker->current, __ATOMIC_ACQUIRE);
+        if (worker->pid == 0 || current == SIZE_MAX) continue;
+        struct ctest_result* res = &ctest_pool->results[current];
+        unsigned int timeout = ctest_test_timeout(res->test);
+        if (timeout == 0) continue;
+        uint64_t deadline = worker->started_ns + (uint64_t) timeout * 1000000u;
+        if (now < deadline) {
+            uint64_t ms = (deadline - now + 999999) / 1000000;
+            if (wait_ms < 0 || ms < (uint64_t) wait_ms) wait_ms = (int) ms;
+            continue;
+        }
+        int pending = CTEST_PENDING;
+        if (!__atomic_compare_exchange_n(&res->status, &pending, CTEST_TIMEOUT, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+        kill(worker->pid, SIGKILL);
+        waitpid(worker->pid, NULL, 0);
+        worker->pid = 0;
+        ctest_worker_timed_out(worker, res, now);
+        if (__atomic_load_n(&ctest_pool->next, __ATOMIC_RELAXED) < ctest_pool->count) {
+            if (ctest_spawn_worker(worker, readfd) != 0) perror("fork");
+        }
+    }
+    return wait_ms;
+}
+
+// reap finished workers, fail the test they were running and replace them
+// while there is work left. Returns the number of live workers
+static int ctest_reap_workers(int readfd) {
+    int wstatus;
+    pid_t pid;
+    int id;
+    int alive = 0;
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+        for (id = 0; id < ctest_jobs; id++) {
+            struct ctest_worker* worker = &ctest_pool->workers[id];
+            if (worker->pid != pid) continue;
+            worker->pid = 0;
+            if (worker->current != SIZE_MAX &&
+                    __atomic_load_n(&ctest_pool->results[worker->current].status, __ATOMIC_ACQUIRE) == CTEST_PENDING) {
+                ctest_worker_died(worker, &ctest_pool->results[worker->current], wstatus);
+            }
+            if (__atomic_load_n(&ctest_pool->next, __ATOMIC_RELAXED) < ctest_pool->count) {
+                if (ctest_spawn_worker(worker, readfd) != 0) perror("fork");
+            }
+        }
+    }
+    for (id = 0; id < ctest_jobs; id++) {
+        if (ctest_pool->workers[id].pid != 0) alive++;
+    }
+    return alive;
+}
+
+// Workers claim tests from the shared queue and notify the parent over a
+// pipe, which prints the results in registration order.
+static void ctest_run_parallel(void) {
+    struct sigaction sa;
+    struct sigaction old_sa;
+    size_t wakeups[64];
+    size_t printed = 0;
+    int fds[2];
+    int id;
+
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        ctest_run_serial();
+        return;
+    }
+    // the parent writes to the pipe too, from ctest_sigchld(). If that blocked
+    // on a full pipe nothing would ever read it
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    ctest_notify_fd = fds[1];
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ctest_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, &old_sa);
+
+    for (id = 0; id < ctest_jobs; id++) {
+        if (ctest_spawn_worker(&ctest_pool->workers[id], fds[0]) != 0) perror("fork");
+    }
+
+    while (printed < ctest_pool->count) {
+        struct pollfd pfd;
+        pfd.fd = fds[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ready = poll(&pfd, 1, ctest_check_timeouts(fds[0]));
+        ssize_t r = 0;
+        // the results are in shared memory, the wakeups only need draining
+        while (ready > 0 && (r = read(fds[0], wakeups, sizeof(wakeups))) > 0) continue;
+        if (r < 0 && errno != EAGAIN && errno != EINTR) {
+            perror("read");
+            break;
+        }
+        int alive = ctest_reap_workers(fds[0]);
+        while (printed < ctest_pool->count) {
+            struct ctest_result* res = &ctest_pool->results[printed];
+            if (alive == 0 && __atomic_load_n(&res->status, __ATOMIC_ACQUIRE) == CTEST_PENDING) {
+                const char msg[] = "  ERR: not run, no workers left\n";
+                ctest_save_msg(res, msg, sizeof(msg)-1);
+                res->status = CTEST_FAIL;
+            }
+            if (__atomic_load_n(&res->status, __ATOMIC_ACQUIRE) == CTEST_PENDING) break;
+            ctest_print_header(printed);
+            if (res->msg_spilled) {
+                char* msg = ctest_load_msg(res);
+                ctest_report(printed, msg ? msg : "", msg ? res->msg_len : 0);
+                free(msg);
+            } else {
+                ctest_report(printed, ctest_pool->msgs + res->msg_offset, res->msg_len);
+            }
+            printed++;
+        }
+        fflush(stdout);
+        ctest_reporters_flush();
+    }
+
+    for (id = 0; id < ctest_jobs; id++) {
+        if (ctest_pool->workers[id].pid != 0) waitpid(ctest_pool->workers[id].pid, NULL, 0);
+    }
+    sigaction(SIGCHLD, &old_sa, NULL);
+    close(fds[0]);
+    close(fds[1]);
+    ctest_notify_fd = -1;
+}
+#endif
+
+static void ctest_usage(const char* progname) {
+    printf("usage: %s [options] [suite]\n"
+           "  --filter=PATTERN   only run the tests whose suite:test matches PATTERN, a glob\n"
+           "                     ('*', '?', '[a-z]') or 're:REGEX'. Can be repeated\n"
+           "  --exclude=PATTERN  don't run the tests that match PATTERN. Can be repeated\n"
+           "  --changed=FILES    only run the tests defined in the changed source FILES,\n"
+           "                     a comma separated list or @FILE with one per line\n"
+           "  --changed-map=FILE also run the tests of 'SOURCE_GLOB TEST_PATTERN' lines\n"
+           "                     in FILE when a changed file matches SOURCE_GLOB\n"
+           "  --list             list the selected tests instead of running them\n"
+           "  --rerun-failed     only run the tests that failed in the last run (if any)\n"
+           "  --failed-first     run the tests that failed in the last run first\n"
+           "  --slowest-first    run the slowest tests of the last run first\n"
+           "  --history=FILE     results of previous runs (default: <program>.ctest-history)\n"
+           "  --no-history       don't read or write the history\n"
+           "  -j, --jobs=N       run tests in N worker processes (-j alone: number of CPUs,\n"
+           "                     default: 1)\n"
+           "  --isolate[=N]      run tests in child processes, N (default 1) per process,\n"
+           "                     so a crashing test doesn't end the run\n"
+           "  --no-isolate       run tests in the ctest process\n"
+           "  --repeat=N         run the tests N times\n"
+           "  --until-fail       repeat until a test fails (at most N times with --repeat)\n"
+           "  --shuffle[=SEED]   run the tests in random order, the seed is printed\n"
+           "  --baseline=FILE    fail the tests that got slower than in FILE, a history file\n"
+           "  --tolerance=PCT    how much slower than the baseline is allowed (default: 20)\n"
+           "  --save-baseline=FILE  write the durations of this run to FILE\n"
+           "  --timeout=MS       stop a test after MS milliseconds, unless it has its own\n"
+           "                     timeout. With -j or --isolate the run goes on\n"
+           "  --update-golden    write the files of ASSERT_DATA_FILE/ASSERT_STR_FILE that\n"
+           "                     don't match, instead of failing\n"
+           "  --time             show the duration of every test\n"
+           "  --perf             show cpu counters (cycles, instructions, misses) of every\n"
+           "                     test and benchmark (Linux only)\n"
+           "  --allocs           show the heap allocations of every test (needs CTEST_MALLOC)\n"
+           "  --asserts          show the number of assertions of every test, and their rate\n"
+           "  --slowest[=N]      list the N slowest tests and suites (default: 10)\n"
+           "  --prop-runs=N      runs per property test (default: 1000, unlimited with --prop-time)\n"
+           "  --prop-time=MS     time budget per property test\n"
+           "  --seed=N           seed of the property test inputs, to replay a failure\n"
+           "  --bench            run the benchmarks (serially) instead of the tests\n"
+           "  --bench-time=MS    time budget per benchmark (default: 1000)\n"
+           "  --bench-samples=N  number of samples per benchmark (default: 20)\n"
+           "  --bench-save=FILE  write the benchmark samples to FILE\n"
+           "  --bench-compare=FILE  compare the benchmarks with those saved in FILE\n"
+           "  --bench-compare=OLD,NEW  compare two saved files, without running anything\n"
+           "  --shard=I/N        only run shard I (0..N-1) of N, split by test name\n"
+           "  --shard-balance    split the shards by the test durations in the history\n"
+           "  --junit=FILE       write a JUnit XML report to FILE\n"
+           "  --json=FILE        write a JSON lines report to FILE\n"
+           "  --tap=FILE         write a TAP report to FILE\n"
+           "  -h, --help         show this help\n",
+           progname);
+}
+
+// returns the value of option 'name' if argv[*i] is that option, NULL otherwise.
+// Accepts both '--name=value' and '--name value', 'optional' values only if numeric
+static const char* ctest_option(int argc, const char *argv[], int* i, const char* name, int optional) {
+    const char* arg = argv[*i];
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0) return NULL;
+    if (arg[len] == '=') return arg + len + 1;
+    if (arg[len] != 0) {
+        // short options take their value directly: -j4
+        return (name[1] != '-') ? arg + len : NULL;
+    }
+    if (*i + 1 < argc && (!optional || (argv[*i+1][0] >= '0' && argv[*i+1][0] <= '9'))) {
+        return argv[++*i];
+    }
+    return optional ? "" : NULL;
+}
+
+static int ctest_parse_reporter(int argc, const char *argv[], int* i) {
+    size_t r;
+    for (r = 0; r < CTEST_NUM_REPORTERS; r++) {
+        const char* val = ctest_option(argc, argv, i, ctest_reporters[r].option, 0);
+        if (val != NULL) {
+            ctest_reporters[r].filename = val;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// returns 1 to run the tests, 0 to exit successfully and -1 on errors
+static int ctest_parse_args(int argc, const char *argv[]) {
+    int i;
+    ctest_patterns = (struct ctest_pattern*) malloc((size_t) argc * sizeof(struct ctest_pattern));
+    if (ctest_patterns == NULL) {
+        perror("ctest");
+        return -1;
+    }
+    for (i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* val;
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            ctest_usage(argv[0]);
+            return 0;
+        } else if ((val = ctest_option(argc, argv, &i, "-j", 1)) != NULL ||
+                   (val = ctest_option(argc, argv, &i, "--jobs", 1)) != NULL) {
+            ctest_jobs = atoi(val);
+            if (ctest_jobs <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+                ctest_jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+                if (ctest_jobs <= 0) ctest_jobs = 1;
+            }
+        } else if ((val = ctest_option(argc, argv, &i, "--isolate", 1)) != NULL) {
+            ctest_isolate = *val ? atoi(val) : 1;
+            if (ctest_isolate < 1) ctest_isolate = 1;
+        } else if (strcmp(arg, "--no-isolate") == 0) {
+            ctest_isolate = 0;
+        } else if ((val = ctest_option(argc, argv, &i, "--filter", 0)) != NULL) {
+            if (ctest_add_pattern(val, 0, 0) != 0) return -1;
+        } else if ((val = ctest_option(argc, argv, &i, "--exclude", 0)) != NULL) {
+            if (ctest_add_pattern(val, 1, 0) != 0) return -1;
+        } else if ((val = ctest_option(argc, argv, &i, "--changed-map", 0)) != NULL) {
+            if (ctest_parse_changed_map(val) != 0) return -1;
+        } else if ((val = ctest_option(argc, argv, &i, "--changed", 0)) != NULL) {
+            if (ctest_parse_changed(val) != 0) return -1;
+        } else if (strcmp(arg, "--list") == 0) {
+            ctest_list = 1;
+        } else if (strcmp(arg, "--rerun-failed") == 0) {
+            ctest_rerun_failed = 1;
+        } else if (strcmp(arg, "--failed-first") == 0) {
+            ctest_failed_first = 1;
+        } else if (strcmp(arg, "--slowest-first") == 0) {
+            ctest_slowest_first = 1;
+        } else if ((val = ctest_option(argc, argv, &i, "--history", 0)) != NULL) {
+            ctest_history_file = val;
+        } else if (strcmp(arg, "--no-history") == 0) {
+            ctest_no_history = 1;
+        } else if ((val = ctest_option(argc, argv, &i, "--repeat", 0)) != NULL) {
+            ctest_repeat = atoi(val);
+            if (ctest_repeat < 1) ctest_repeat = 1;
+        } else if (strcmp(arg, "--until-fail") == 0) {
+            ctest_until_fail = 1;
+        } else if ((val = ctest_option(argc, argv, &i, "--shuffle", 1)) != NULL) {
+            ctest_shuffle = 1;
+            if (*val) ctest_seed = (uint64_t) strtoull(val, NULL, 10);
+            else ctest_seed = (uint64_t) time(NULL) ^ ctest_now_ns();
+        } else if ((val = ctest_option(argc, argv, &i, "--baseline", 0)) != NULL) {
+            ctest_baseline_file = val;
+        } else if ((val = ctest_option(argc, argv, &i, "--tolerance", 0)) != NULL) {
+            ctest_tolerance = atoi(val);
+            if (ctest_tolerance < 0) ctest_tolerance = 0;
+        } else if ((val = ctest_option(argc, argv, &i, "--save-baseline", 0)) != NULL) {
+            ctest_save_baseline_file = val;
+        } else if ((val = ctest_option(argc, argv, &i, "--timeout", 0)) != NULL) {
+            ctest_timeout_ms = (unsigned int) strtoul(val, NULL, 10);
+#ifndef CTEST_IMPL_FORK
+            fprintf(stderr, "ctest: --timeout is not supported on this platform\n");
+#endif
+        } else if (strcmp(arg, "--update-golden") == 0) {
+            ctest_update_golden = 1;
+        } else if (strcmp(arg, "--time") == 0) {
+            ctest_show_time = 1;
+        } else if (strcmp(arg, "--perf") == 0) {
+            ctest_perf = 1;
+#ifndef CTEST_IMPL_PERF
+            fprintf(stderr, "ctest: --perf is only supported on Linux\n");
+#endif
+        } else if (strcmp(arg, "--allocs") == 0) {
+            ctest_show_allocs = 1;
+        } else if (strcmp(arg, "--asserts") == 0) {
+            ctest_show_asserts = 1;
+        } else if ((val = ctest_option(argc, argv, &i, "--slowest", 1)) != NULL) {
+            ctest_num_slowest = *val ? atoi(val) : 10;
+        } else if ((val = ctest_option(argc, argv, &i, "--prop-runs", 0)) != NULL) {
+            ctest_prop_runs = (uint64_t) strtoull(val, NULL, 10);
+        } else if ((val = ctest_option(argc, argv, &i, "--prop-time", 0)) != NULL) {
+            ctest_prop_time_ns = (uint64_t) strtoull(val, NULL, 10) * 1000000u;
+        } else if ((val = ctest_option(argc, argv, &i, "--seed", 0)) != NULL) {
+            ctest_prop_seed = (uint64_t) strtoull(val, NULL, 10);
+            ctest_prop_seeded = 1;
+        } else if (strcmp(arg, "--bench") == 0) {
+            ctest_bench = 1;
+        } else if ((val = ctest_option(argc, argv, &i, "--bench-time", 0)) != NULL) {
+            ctest_bench_time_ns = (uint64_t) strtoull(val, NULL, 10) * 1000000u;
+            if (ctest_bench_time_ns == 0) ctest_bench_time_ns = 1000000u;
+        } else if ((val = ctest_option(argc, argv, &i, "--bench-samples", 0)) != NULL) {
+            ctest_bench_samples = atoi(val);
+            if (ctest_bench_samples < 1) ctest_bench_samples = 1;
+            if (ctest_bench_samples > CTEST_BENCH_MAX_SAMPLES) ctest_bench_samples = CTEST_BENCH_MAX_SAMPLES;
+        } else if ((val = ctest_option(argc, argv, &i, "--bench-save", 0)) != NULL) {
+            ctest_bench_save_file = val;
+        } else if ((val = ctest_option(argc, argv, &i, "--bench-compare", 0)) != NULL) {
+            ctest_bench_compare_file = val;
+        } else if ((val = ctest_option(argc, argv, &i, "--shard", 0)) != NULL) {
+            char* end;
+            ctest_shard_index = (int) strtol(val, &end, 10);
+            ctest_shard_count = (*end == '/') ? (int) strtol(end + 1, &end, 10) : 0;
+            if (*end != 0 || ctest_shard_count <= 0 || ctest_shard_index < 0 || ctest_shard_index >= ctest_shard_count) {
+                fprintf(stderr, "invalid shard '%s', expected I/N with 0 <= I < N\n", val);
+                return -1;
+            }
+        } else if (strcmp(arg, "--shard-balance") == 0) {
+            ctest_shard_balance = 1;
+        } else if (ctest_parse_reporter(argc, argv, &i)) {
+            continue;
+        } else if (arg[0] == '-') {
+            fprintf(stderr, "unknown option '%s'\n", arg);
+            ctest_usage(argv[0]);
+            return -1;
+        } else {
+            // a plain argument selects the suites starting with it
+            if (ctest_add_pattern(arg, 0, 1) != 0) return -1;
+        }
+    }
+    return 1;
+}
+
+int ctest_main(int argc, const char *argv[]);
+
+int ctest_main(int argc, const char *argv[])
+{
+    size_t total = 0;
+    size_t i;
+
+    ctest_is_runner = 1;
+#ifdef CTEST_IMPL_FORK
+    ctest_runner = pthread_self();
+    if (pthread_key_create) ctest_thread_key_ok = pthread_key_create(&ctest_thread_key, ctest_thread_exit) == 0;
+#endif
+    int ret = ctest_parse_args(argc, argv);
+    if (ret <= 0) {
+        ctest_free_patterns();
+        return ret < 0;
+    }
+
+#ifdef CTEST_SEGFAULT
+    signal(SIGSEGV, sighandler);
+#endif
+
+#ifdef CTEST_NO_COLORS
+    color_output = 0;
+#else
+    color_output = isatty(1);
+#endif
+    if (ctest_bench_compare_file && strchr(ctest_bench_compare_file, ',')) {
+        ctest_free_patterns();
+        return ctest_bench_compare_files(ctest_bench_compare_file);
+    }
+    uint64_t t1 = ctest_now_ns();
+    if (!ctest_prop_seeded) ctest_prop_seed = (uint64_t) time(NULL) ^ t1;
+
+    if (ctest_build_index() != 0) {
+        perror("ctest");
+        return 1;
+    }
+    size_t max_selected = 0;
+    for (i = 0; i < ctest_index_size; i++) {
+        max_selected += ctest_index[i]->num_cases ? ctest_index[i]->num_cases : 1;
+    }
+    struct ctest** selected = (struct ctest**) malloc((max_selected + 1) * sizeof(struct ctest*));
+    if (selected == NULL) {
+        perror("ctest");
+        return 1;
+    }
+    size_t num_filtered = 0;
+    ctest_changed_prepare();
+    for (i = 0; i < ctest_index_size; i++) {
+        struct ctest* t = ctest_index[i];
+        if (t->num_cases) {
+            if (ctest_select_cases(t, selected, &total, &num_filtered) == 0) continue;
+            perror("ctest");
+            ctest_free_patterns();
+            ctest_free_cases();
+            free(selected);
+            return 1;
+        }
+        if (!ctest_select(t)) continue;
+        num_filtered++;
+        if (!ctest_in_shard(t)) continue;
+        selected[total++] = t;
+    }
+    ctest_free_patterns();
+    ctest_history_load(argv[0]);
+    if (ctest_shard_count && ctest_shard_balance) total = ctest_shard_balance_tests(selected, total);
+    if (ctest_baseline_file && ctest_history_read(&ctest_baseline, ctest_baseline_file) != 0) {
+        fprintf(stderr, "cannot read baseline '%s'\n", ctest_baseline_file);
+        ctest_free_cases();
+        free(selected);
+        ctest_history_free(&ctest_history);
+        return 1;
+    }
+    if (ctest_rerun_failed) {
+        size_t num_failed = 0;
+        for (i = 0; i < total; i++) {
+            if (ctest_history_failed(selected[i])) selected[num_failed++] = selected[i];
+        }
+        if (num_failed > 0) total = num_failed;
+        else printf("no failed tests in the last run, running all tests\n");
+    }
+    ctest_order_tests(selected, total);
+    if (ctest_list) {
+        for (i = 0; i < total; i++) printf("%s:%s\n", selected[i]->ssname, selected[i]->ttname);
+        ctest_free_cases();
+        free(selected);
+        ctest_history_free(&ctest_history);
+        return 0;
+    }
+    if (ctest_shard_count) {
+        printf("SHARD %d/%d: running %d of %d tests\n", ctest_shard_index, ctest_shard_count, (int) total, (int) num_filtered);
+    }
+
+#ifdef CTEST_IMPL_FORK
+    if (ctest_bench) ctest_jobs = 1;    // don't let benchmarks compete for cpus
+    if (ctest_jobs > 1 && (size_t) ctest_jobs > total) ctest_jobs = total > 1 ? (int) total : 1;
+#else
+    ctest_jobs = 1;
+    ctest_isolate = 0;
+#endif
+    int use_workers = ctest_jobs > 1 || ctest_isolate > 0;
+    ctest_pool = ctest_pool_create(total, use_workers);
+    ctest_stats = (struct ctest_test_stats*) calloc(total + 1, sizeof(struct ctest_test_stats));
+    size_t* order = (size_t*) malloc((total + 1) * sizeof(size_t));
+    if (ctest_pool == NULL || ctest_stats == NULL || order == NULL) {
+        perror("ctest");
+        if (ctest_pool) ctest_pool_destroy(ctest_pool);
+        free(ctest_stats);
+        free(order);
+        free(selected);
+        ctest_free_cases();
+        return 1;
+    }
+    for (i = 0; i < total; i++) {
+        ctest_stats[i].test = selected[i];
+        order[i] = i;
+    }
+    if (ctest_bench && (ctest_bench_save_file || ctest_bench_compare_file)) {
+        ctest_bench_store = (double*) calloc(total * (size_t) ctest_bench_samples + 1, sizeof(double));
+        if (ctest_bench_store == NULL) perror("ctest");
+    }
+    free(selected);
+    ctest_max_rounds = ctest_repeat ? ctest_repeat : (ctest_until_fail ? 0 : 1);
+    if (ctest_shuffle) printf("SHUFFLE: seed %" PRIu64 "\n", ctest_seed);
+    int ok = ctest_reporters_open() == 0;
+
+    for (ctest_round = 1; ok && (ctest_max_rounds == 0 || ctest_round <= ctest_max_rounds); ctest_round++) {
+        if (ctest_shuffle) ctest_shuffle_order(order, total, &ctest_seed);
+        ctest_pool_reset(ctest_pool, order);
+        if (ctest_suites_create() != 0) {
+            perror("ctest");
+            ok = 0;
+            break;
+        }
+        if (ctest_max_rounds == 0) printf("ROUND %d\n", ctest_round);
+        else if (ctest_max_rounds > 1) printf("ROUND %d/%d\n", ctest_round, ctest_max_rounds);
+#ifdef CTEST_IMPL_FORK
+        if (use_workers) ctest_run_parallel();
+        else
+#endif
+        ctest_run_serial();
+        if (ctest_until_fail && ctest_num_fail > 0) {
+            ctest_round++;
+            break;
+        }
+    }
+    uint64_t t2 = ctest_now_ns();
+    if (ok) {
+        if (ctest_num_slowest > 0) ctest_print_slowest();
+        if (ctest_max_rounds != 1) ctest_print_stats(total, ctest_round - 1);
+        ctest_bench_report();
+
+        const char* color = (ctest_num_fail) ? ANSI_BRED : ANSI_GREEN;
+        char results[160];
+        snprintf(results, sizeof(results), "RESULTS: %d tests (%d ok, %d failed, %d skipped), %" PRIu64 " asserts, ran in %.1f ms",
+                 ctest_num_ok + ctest_num_fail + ctest_num_skip, ctest_num_ok, ctest_num_fail, ctest_num_skip,
+                 ctest_num_asserts, (double)(t2 - t1) / 1e6);
+        color_print(color, results);
+        ctest_history_save();
+    }
+    ctest_reporters_close(t2 - t1);
+    ctest_history_free(&ctest_history);
+    ctest_history_free(&ctest_baseline);
+    ctest_pool_destroy(ctest_pool);
+    ctest_pool = NULL;
+    free(ctest_bench_store);
+    ctest_bench_store = NULL;
+    free(ctest_suites);
+    ctest_suites = NULL;
+    free(ctest_stats);
+    ctest_stats = NULL;
+    free(order);
+    ctest_free_cases();
+    return ok ? ctest_num_fail : 1;
 }
 
 #endif
@@ -13,7 +13,10 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "ctest.h"
 
 // basic test without setup/teardown
@@ -66,6 +69,32 @@ CTEST2(memtest, test2) {
     ASSERT_FAIL();
 }
 
+// A suite with a setup/teardown that is called only once, around all its tests
+CTEST_DATA(table) {
+    int* squares;
+    int size;
+};
+
+// Fields set here are copied into the data of every test in the suite
+CTEST_SUITE_SETUP(table) {
+    int i;
+    data->size = 100;
+    data->squares = (int*)malloc(sizeof(int) * (size_t)data->size);
+    for (i = 0; i < data->size; i++) data->squares[i] = i * i;
+}
+
+CTEST_SUITE_TEARDOWN(table) {
+    free(data->squares);
+}
+
+CTEST2(table, first) {
+    ASSERT_EQUAL(0, data->squares[0]);
+}
+
+CTEST2(table, last) {
+    ASSERT_EQUAL(99 * 99, data->squares[data->size - 1]);
+}
+
 
 CTEST_DATA(fail) {
     int unused;
@@ -230,8 +259,120 @@ CTEST(ctest, test_dbl_compare) {
     ASSERT_DBL_GT(0.000001, a);  /* fail */
 }
 
+CTEST(ctest, test_assert_data) {
+    unsigned char exp[64] = { 0 };
+    unsigned char real[64] = { 0 };
+    ASSERT_DATA(exp, sizeof(exp), real, sizeof(real));
+    real[20] = 0x20;
+    real[23] = 0x23;
+    ASSERT_DATA(exp, sizeof(exp), real, sizeof(real));  /* fail, shows a hexdump */
+}
+
+// fails if it takes longer than 100 ms, even when all assertions pass
+CTEST_BUDGET(ctest, test_budget, 100) {
+    ASSERT_TRUE(1);
+}
+
+// stopped (and failed) when it takes longer than 1 second, see --timeout
+CTEST_TIMEOUT(ctest, test_timeout, 1000) {
+    ASSERT_TRUE(1);
+}
+
+// logs until its timeout stops it at one of the log calls, the run goes on
+// (where timeouts aren't supported it ends after a second)
+CTEST_TIMEOUT(ctest, test_timeout_log, 10) {
+    unsigned long i = 0;
+    while (i < 1000) {
+        clock_t start = clock();
+        while (clock() - start < CLOCKS_PER_SEC / 1000) continue;
+        CTEST_LOG("iteration %lu", i++);
+    }
+}
+
+CTEST(ctest, test_no_alloc) {
+    int sum = 0;
+    ASSERT_NO_ALLOC(sum += 1);  /* only checked when built with CTEST_MALLOC */
+    ASSERT_EQUAL(1, sum);
+}
+
 CTEST(ctest, test_str_contains) {
     ASSERT_NOT_STR("Hello", "World");
     ASSERT_STRSTR("Hello", "ello");
     ASSERT_NOT_STRSTR("Hello", "ello");
 }
+
+// one test per row: param:atoi/0, param:atoi/1, ... (the last row fails)
+struct atoi_case {
+    const char* text;
+    int value;
+};
+
+static const struct atoi_case atoi_cases[] = {
+    { "0", 0 },
+    { "42", 42 },
+    { "-7", -7 },
+    { "12abc", 13 },
+};
+
+CTEST_PARAM(param, atoi, atoi_cases) {
+    ASSERT_EQUAL(param->value, atoi(param->text));
+}
+
+// rows can also be generated, for sets too large to write down
+static void make_square(size_t row, long* value) {
+    *value = (long) row * (long) row;
+}
+
+CTEST_PARAM_GEN(param, square, long, 10, make_square) {
+    ASSERT_TRUE(*param >= 0);
+}
+
+// property tests run with many generated inputs, a failure is shrunk
+CTEST_PROPERTY(property, atoi_roundtrip) {
+    char buf[32];
+    int64_t value = ctest_gen_int(-1000000, 1000000);
+    snprintf(buf, sizeof(buf), "%d", (int) value);
+    ASSERT_EQUAL(value, atoi(buf));
+}
+
+// fails, the input is shrunk to a minimal one before it's logged
+CTEST_PROPERTY(property, short_strings) {
+    const char* str = ctest_gen_str(0, 20);
+    ASSERT_TRUE(strchr(str, '!') == NULL);
+}
+
+// benchmarks only run with './test --bench', the body is called in a loop
+CTEST_BENCH(bench, strlen) {
+    static const char str[] = "some string to measure";
+    size_t len = strlen(str);
+    CTEST_BENCH_KEEP(len);
+}
+
+CTEST_DATA(bench) {
+    unsigned char* buffer;
+};
+
+// setup/teardown are called once, not for every iteration
+CTEST_SETUP(bench) {
+    data->buffer = (unsigned char*)malloc(4096);
+}
+
+CTEST_TEARDOWN(bench) {
+    free(data->buffer);
+}
+
+CTEST2_BENCH(bench, memset) {
+    memset(data->buffer, 0x55, 4096);
+    CTEST_BENCH_KEEP(data->buffer[0]);
+}
+
+#ifdef CTEST_STRESS
+// many tiny tests for 'make check', which runs them in a process each
+static void make_row(size_t row, int* value) {
+    *value = (int) row;
+}
+
+CTEST_PARAM_GEN(stress, isolate, int, 20000, make_row) {
+    ASSERT_TRUE(*param >= 0);
+}
+#endif